@@ -0,0 +1,20 @@
+/**
+ *  Shared harness for the host tests. CHECK records a failure and carries on, so one run reports every failed check;
+ *  report() prints the PASSED/FAILED line for the test and returns its exit status.
+ */
+
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("FAILED %s:%d: %s\n",__FILE__,__LINE__,#cond); failures++; } } while(0)
+
+static inline int report(const char* name) {
+  printf("%s: %s\n",name,(failures == 0 ? "PASSED" : "FAILED"));
+  return (failures == 0 ? 0 : 1);
+}
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ *  Host test for PortalTrace: record a session, dump it with write() as a device would, and replay the dump.
+ *  Build and run with:  make -C extras/test test
+ */
+
+#include "PortalTrace.h"
+#include "host_test.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace lsc;
+
+class Recorder : public TraceListener {
+  public:
+  void pace(unsigned long at) {paced.push_back(at);}
+  void onRequest(unsigned long at, const char* uri, int argc, const char** names, const char** values) {
+    std::string s = std::to_string(at) + " REQ " + uri;
+    for( int i=0; i<argc; i++ ) s += std::string(" ") + names[i] + "=" + values[i];
+    events.push_back(s);
+  }
+  void onStatus(unsigned long at, int status)                        {events.push_back(std::to_string(at) + " STATUS " + std::to_string(status));}
+  void onScan(unsigned long at, int count)                           {events.push_back(std::to_string(at) + " SCAN " + std::to_string(count));}
+  void onScanResult(unsigned long at, int rssi, int ch, const char* ssid) {
+    events.push_back(std::to_string(at) + " AP " + std::to_string(rssi) + " " + std::to_string(ch) + " " + ssid);
+  }
+  std::vector<std::string>   events;
+  std::vector<unsigned long> paced;
+};
+
+static std::vector<uint8_t> dump(PortalTrace& trace) {
+  std::vector<uint8_t> out;
+  trace.write([&out](const uint8_t* b, size_t n){out.insert(out.end(),b,b+n);});
+  return out;
+}
+
+static void testRoundTrip() {
+  uint8_t     buffer[256];
+  PortalTrace trace;
+  trace.begin(buffer,sizeof(buffer),1000);
+  const char* names[]  = {"ssid","psk"};
+  const char* values[] = {"HomeNet","*"};
+  trace.status(1000,7);
+  trace.request(1010,"/",0,NULL,NULL);
+  trace.scan(3000,2);
+  trace.scanResult(3000,-48,6,"HomeNet");
+  trace.scanResult(3000,-81,11,"HomeNet");
+  trace.request(9000,"/connect",2,names,values);
+  trace.status(9500,7);                              // Unchanged, not recorded
+  trace.status(12000,3);
+
+  Recorder r;
+  CHECK(PortalTrace::replay(trace.data(),trace.length(),&r) == 7);
+  std::vector<uint8_t> d = dump(trace);
+  Recorder rd;
+  CHECK(d.size() == trace.length() + TRACE_HEADER);
+  CHECK(PortalTrace::replayDump(d.data(),d.size(),&rd,true) == 7);
+  CHECK(rd.events == r.events);
+  CHECK(rd.paced.size() == 7 && rd.paced.back() == 11000);
+  CHECK(r.paced.empty());
+  CHECK(r.events.size() == 7);
+  if( r.events.size() == 7 ) {
+    CHECK(r.events[0] == "0 STATUS 7");
+    CHECK(r.events[1] == "10 REQ /");
+    CHECK(r.events[3] == "2000 AP -48 6 HomeNet");
+    CHECK(r.events[5] == "8000 REQ /connect ssid=HomeNet psk=*");
+    CHECK(r.events[6] == "11000 STATUS 3");
+  }
+}
+
+static void testOverflow() {
+  uint8_t     buffer[24];
+  PortalTrace trace;
+  trace.begin(buffer,sizeof(buffer),0);
+  trace.request(5,"/apForm",0,NULL,NULL);
+  size_t len = trace.length();
+  trace.request(6,"/a/uri/that/does/not/fit/in/the/buffer",0,NULL,NULL);
+  CHECK(trace.overflow());
+  CHECK(!trace.enabled());
+  CHECK(trace.length() == len);
+  Recorder r;
+  CHECK(PortalTrace::replay(trace.data(),trace.length(),&r) == 1);
+}
+
+static void testMalformed() {
+  uint8_t     buffer[64];
+  PortalTrace trace;
+  trace.begin(buffer,sizeof(buffer),0);
+  trace.request(5,"/apForm",0,NULL,NULL);
+  std::vector<uint8_t> d = dump(trace);
+  Recorder r;
+  CHECK(PortalTrace::replayDump(d.data(),d.size() - 1,&r) == -1);     // Truncated
+  CHECK(PortalTrace::replay(d.data(),d.size(),&r) == -1);             // Header not accepted as records
+  d[0] ^= 0xFF;
+  CHECK(PortalTrace::replayDump(d.data(),d.size(),&r) == -1);         // Bad magic
+}
+
+int main() {
+  testRoundTrip();
+  testOverflow();
+  testMalformed();
+  return report("portal_trace_test");
+}
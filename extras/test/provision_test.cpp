@@ -0,0 +1,248 @@
+/**
+ *  Host test for headless provisioning: drive ProvisionChannel through a fake Stream, and through real UDP sockets on the
+ *  loopback interface, with a fake connector standing in for WiFiPortal::provision().
+ *  Build and run with:  make -C extras/test test
+ */
+
+#include "ProvisionChannel.h"
+#include "host_test.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace lsc;
+
+/**
+ *  Minimal Stream: input is consumed a character at a time, output is captured
+ */
+class FakeStream {
+  public:
+  int    available()           {return (int)(_in.size() - _pos);}
+  int    read()                {return (_pos < _in.size() ? (unsigned char)_in[_pos++] : -1);}
+  size_t print(const char* s)  {_out += s; return strlen(s);}
+  void   input(const std::string& s) {_in += s;}
+  std::string take()           {std::string s = _out; _out.clear(); return s;}
+
+  private:
+  std::string _in;
+  size_t      _pos = 0;
+  std::string _out;
+};
+
+/**
+ *  The WiFiUDP calls ProvisionChannel uses, over a POSIX socket bound to the loopback interface. As with WiFiUDP, an
+ *  unread remainder of a datagram is dropped by the next parsePacket().
+ */
+class LoopbackUDP {
+  public:
+  LoopbackUDP() {
+    _fd = socket(AF_INET,SOCK_DGRAM,0);
+    sockaddr_in addr = local(0);
+    bind(_fd,(sockaddr*)&addr,sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(_fd,(sockaddr*)&addr,&len);
+    _port = ntohs(addr.sin_port);
+  }
+  ~LoopbackUDP()                {close(_fd);}
+
+  int      parsePacket() {
+    if( _pending ) recv(_fd,NULL,0,MSG_DONTWAIT);
+    socklen_t len = sizeof(_remote);
+    int n = recvfrom(_fd,NULL,0,MSG_PEEK|MSG_TRUNC|MSG_DONTWAIT,(sockaddr*)&_remote,&len);
+    _pending = (n >= 0);
+    return (n > 0 ? n : 0);
+  }
+  int      read(unsigned char* buffer, size_t size) {
+    if( !_pending ) return 0;
+    _pending = false;
+    return (int)recv(_fd,buffer,size,MSG_DONTWAIT);
+  }
+  uint32_t remoteIP()           {return _remote.sin_addr.s_addr;}
+  uint16_t remotePort()         {return ntohs(_remote.sin_port);}
+  int      beginPacket(uint32_t ip, uint16_t port) {_to = local(port); _to.sin_addr.s_addr = ip; _out.clear(); return 1;}
+  size_t   write(const uint8_t* b, size_t n) {_out.append((const char*)b,n); return n;}
+  int      endPacket()          {return (sendto(_fd,_out.data(),_out.size(),0,(sockaddr*)&_to,sizeof(_to)) >= 0);}
+
+  uint16_t port()               {return _port;}
+  void     sendTo(uint16_t port, const std::string& msg) {
+    sockaddr_in to = local(port);
+    sendto(_fd,msg.data(),msg.size(),0,(sockaddr*)&to,sizeof(to));
+  }
+  std::string receive() {
+    timeval tv = {1,0};
+    setsockopt(_fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    char buf[512];
+    ssize_t n = recv(_fd,buf,sizeof(buf),0);
+    return (n > 0 ? std::string(buf,n) : std::string());
+  }
+
+  private:
+  static sockaddr_in local(uint16_t port) {
+    sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+    return addr;
+  }
+
+  int         _fd;
+  uint16_t    _port    = 0;
+  bool        _pending = false;
+  sockaddr_in _remote  = {};
+  sockaddr_in _to      = {};
+  std::string _out;
+};
+
+/**
+ *  Connector accepting one known network
+ */
+static std::vector<std::string> attempts;
+static void fakeConnect(const char* ssid, const char* psk, char* reply, size_t size) {
+  attempts.push_back(std::string(ssid) + "/" + psk);
+  if( strcmp(ssid,"Factory") == 0 && strcmp(psk,"line42pass") == 0 ) snprintf(reply,size,"OK\t%s\t10.0.0.17\n",ssid);
+  else snprintf(reply,size,"FAIL\t%s\tWL_CONNECT_FAILED\n",ssid);
+}
+
+static void testCommands() {
+  ProvisionChannel channel;
+  FakeStream       s;
+  attempts.clear();
+
+  s.input("WIFI\tFactory\tline42pass\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "OK\tFactory\t10.0.0.17\n");
+
+  s.input("WIFI\tFactory\twrong\r\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "FAIL\tFactory\tWL_CONNECT_FAILED\n");
+
+  s.input("HELLO\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "ERR\tbad command\n");
+
+  s.input("WIFI\tFactory\t\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "ERR\tbad command\n");
+
+  s.input("\n\r\n");                                     // Blank lines are ignored
+  CHECK(!channel.poll(s,fakeConnect));
+  CHECK(s.take().empty());
+  CHECK(attempts.size() == 2);
+}
+
+static void testPartialLines() {
+  ProvisionChannel channel;
+  FakeStream       s;
+  attempts.clear();
+  s.input("WIFI\tFac");
+  CHECK(!channel.poll(s,fakeConnect));
+  s.input("tory\tline42");
+  CHECK(!channel.poll(s,fakeConnect));
+  s.input("pass\nWIFI\tOther\tsecret12\n");
+  CHECK(channel.poll(s,fakeConnect));                   // One command per poll
+  CHECK(s.take() == "OK\tFactory\t10.0.0.17\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "FAIL\tOther\tWL_CONNECT_FAILED\n");
+}
+
+static void testOverlong() {
+  ProvisionChannel channel;
+  FakeStream       s;
+  attempts.clear();
+  s.input("WIFI\tFactory\t" + std::string(PROVISION_LINE_SIZE,'x') + "\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "ERR\tline too long\n");
+  CHECK(attempts.empty());                               // Never attempted with a truncated PSK
+
+  s.input("WIFI\tFactory\tline42pass\n");                // Channel recovers on the next line
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "OK\tFactory\t10.0.0.17\n");
+
+  char line[] = "WIFI\tFactory\tline42pass";             // Datagram path
+  char reply[PROVISION_LINE_SIZE];
+  ProvisionChannel::command(line,true,fakeConnect,reply,sizeof(reply));
+  CHECK(strcmp(reply,"ERR\tline too long\n") == 0);
+}
+
+/**
+ *  Send one datagram from sender to portal and poll until the portal handles it
+ */
+static bool deliver(LoopbackUDP& sender, LoopbackUDP& portal, const std::string& msg) {
+  sender.sendTo(portal.port(),msg);
+  for( int i=0; i<100; i++ ) {
+    if( ProvisionChannel::pollDatagram(portal,fakeConnect) ) return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+static void testDatagrams() {
+  LoopbackUDP portal;
+  LoopbackUDP fixture;
+  attempts.clear();
+  CHECK(!ProvisionChannel::pollDatagram(portal,fakeConnect));      // Nothing waiting
+
+  CHECK(deliver(fixture,portal,"WIFI\tFactory\tline42pass\n"));
+  CHECK(fixture.receive() == "ACK\tFactory\n");                    // ACK arrives before the result
+  CHECK(fixture.receive() == "OK\tFactory\t10.0.0.17\n");
+
+  CHECK(deliver(fixture,portal,"WIFI\tFactory\twrong"));           // No line ending needed in a datagram
+  CHECK(fixture.receive() == "ACK\tFactory\n");
+  CHECK(fixture.receive() == "FAIL\tFactory\tWL_CONNECT_FAILED\n");
+
+  CHECK(deliver(fixture,portal,"HELLO\r\n"));                       // Malformed commands are not acknowledged
+  CHECK(fixture.receive() == "ERR\tbad command\n");
+  CHECK(attempts.size() == 2);
+
+  CHECK(deliver(fixture,portal,"WIFI\tFactory\t" + std::string(2*PROVISION_LINE_SIZE,'x')));
+  CHECK(fixture.receive() == "ERR\tline too long\n");
+  CHECK(deliver(fixture,portal,"WIFI\tFactory\tline42pass\n"));  // Unread remainder does not leak into the next one
+  CHECK(fixture.receive() == "ACK\tFactory\n");
+  CHECK(fixture.receive() == "OK\tFactory\t10.0.0.17\n");
+  CHECK(attempts.size() == 3);
+}
+
+/**
+ *  Serial and UDP accept the same longest command, PROVISION_LINE_SIZE-1 characters before CR/LF, and refuse one more
+ */
+static void testLineLimit() {
+  std::string longest = "WIFI\tFactory\t" + std::string(PROVISION_LINE_SIZE - 1 - 13,'x');
+  std::string over    = longest + "x";
+  CHECK(longest.size() == PROVISION_LINE_SIZE - 1);
+
+  ProvisionChannel channel;
+  FakeStream       s;
+  s.input(longest + "\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "FAIL\tFactory\tWL_CONNECT_FAILED\n");
+  s.input(over + "\n");
+  CHECK(channel.poll(s,fakeConnect));
+  CHECK(s.take() == "ERR\tline too long\n");
+
+  LoopbackUDP portal;
+  LoopbackUDP fixture;
+  const char* endings[] = {"", "\n", "\r\n"};
+  for( const char* eol : endings ) {
+    CHECK(deliver(fixture,portal,longest + eol));
+    CHECK(fixture.receive() == "ACK\tFactory\n");
+    CHECK(fixture.receive() == "FAIL\tFactory\tWL_CONNECT_FAILED\n");
+    CHECK(deliver(fixture,portal,over + eol));
+    CHECK(fixture.receive() == "ERR\tline too long\n");
+  }
+}
+
+int main() {
+  testCommands();
+  testPartialLines();
+  testOverlong();
+  testDatagrams();
+  testLineLimit();
+  return report("provision_test");
+}
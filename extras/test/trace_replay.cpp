@@ -0,0 +1,67 @@
+/**
+ *  Replay a portal trace dumped from a device with PortalTrace::write().
+ *     trace_replay [--realtime] trace.bin
+ *  Records are printed in order with their timestamps. Without --realtime the trace runs as fast as possible, with it 
+ *  each record is delayed to its recorded offset from the start of the replay.
+ */
+
+#include "PortalTrace.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace lsc;
+
+class Printer : public TraceListener {
+  public:
+  Printer() : _start(std::chrono::steady_clock::now()) {}
+  void pace(unsigned long at) {std::this_thread::sleep_until(_start + std::chrono::milliseconds(at));}
+  void onRequest(unsigned long at, const char* uri, int argc, const char** names, const char** values) {
+    printf("%8lu  REQUEST  %s",at,uri);
+    for( int i=0; i<argc; i++ ) printf("%s%s=%s",(i == 0 ? "?" : "&"),names[i],values[i]);
+    printf("\n");
+  }
+  void onStatus(unsigned long at, int status)                             {printf("%8lu  STATUS   %d\n",at,status);}
+  void onScan(unsigned long at, int count)                                {printf("%8lu  SCAN     %d results\n",at,count);}
+  void onScanResult(unsigned long at, int rssi, int channel, const char* ssid) {printf("%8lu  AP       %4d dBm  ch %2d  %s\n",at,rssi,channel,ssid);}
+
+  private:
+  std::chrono::steady_clock::time_point _start;
+};
+
+int main(int argc, char** argv) {
+  bool        realtime = false;
+  const char* path     = NULL;
+  for( int i=1; i<argc; i++ ) {
+    if( strcmp(argv[i],"--realtime") == 0 ) realtime = true;
+    else path = argv[i];
+  }
+  if( path == NULL ) {
+    fprintf(stderr,"usage: %s [--realtime] trace.bin\n",argv[0]);
+    return 2;
+  }
+  FILE* f = fopen(path,"rb");
+  if( f == NULL ) {
+    perror(path);
+    return 2;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t  n;
+  while( (n = fread(chunk,1,sizeof(chunk),f)) > 0 ) data.insert(data.end(),chunk,chunk + n);
+  fclose(f);
+
+  Printer printer;
+  auto    start = std::chrono::steady_clock::now();
+  int     count = PortalTrace::replayDump(data.data(),data.size(),&printer,realtime);
+  double  ms    = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+  fflush(stdout);
+  if( count < 0 ) {
+    fprintf(stderr,"%s: not a valid portal trace\n",path);
+    return 1;
+  }
+  fprintf(stderr,"%d records replayed in %.3f ms\n",count,ms);
+  return 0;
+}
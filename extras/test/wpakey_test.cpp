@@ -0,0 +1,82 @@
+/**
+ *  Host test for WPAKey: PBKDF2-HMAC-SHA1 against the RFC 6070 vectors, PMK derivation against the IEEE 802.11i
+ *  (Annex H.4) vectors, and a benchmark of one PMK derivation.
+ *  Build and run with:  make -C extras/test test
+ */
+
+#include "WPAKey.h"
+#include "host_test.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+using namespace lsc;
+
+static void toHex(const uint8_t* b, size_t n, char* hex) {
+  for( size_t i=0; i<n; i++ ) sprintf(hex+2*i,"%02x",b[i]);
+  hex[2*n] = '\0';
+}
+
+static bool pbkdf2Matches(const char* password, size_t passwordLen, const char* salt, size_t saltLen,
+                          uint32_t iterations, const char* expected) {
+  uint8_t out[32];
+  char    hex[65];
+  size_t  outLen = strlen(expected)/2;
+  WPAKey::pbkdf2((const uint8_t*)password,passwordLen,(const uint8_t*)salt,saltLen,iterations,out,outLen);
+  toHex(out,outLen,hex);
+  return strcmp(hex,expected) == 0;
+}
+
+/**
+ *  RFC 6070 PBKDF2-HMAC-SHA1 vectors. The 16777216 iteration case is left out for run time.
+ */
+static void testRFC6070() {
+  CHECK(pbkdf2Matches("password",8,"salt",4,1,"0c60c80f961f0e71f3a9b524af6012062fe037a6"));
+  CHECK(pbkdf2Matches("password",8,"salt",4,2,"ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957"));
+  CHECK(pbkdf2Matches("password",8,"salt",4,4096,"4b007901b765489abead49d926f721d065a429c1"));
+  CHECK(pbkdf2Matches("passwordPASSWORDpassword",24,"saltSALTsaltSALTsaltSALTsaltSALTsalt",36,4096,
+                      "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038"));
+  CHECK(pbkdf2Matches("pass\0word",9,"sa\0lt",5,4096,"56fa6aa75548099dcc37d7f03425e0c3"));
+}
+
+/**
+ *  IEEE 802.11i passphrase to PMK vectors, and the hex form WiFiPortal hands to WiFi
+ */
+static void testPMK() {
+  char hex[PMK_HEX_SIZE];
+  CHECK(WPAKey::derivePMK("password","IEEE",hex));
+  CHECK(strcmp(hex,"f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e") == 0);
+  CHECK(WPAKey::isPMK(hex));
+  CHECK(WPAKey::derivePMK("ThisIsAPassword","ThisIsASSID",hex));
+  CHECK(strcmp(hex,"0dc0d6eb90555ed6419756b9a15ec3e3209b63df707dd508d14581f8982721af") == 0);
+
+  uint8_t pmk[PMK_SIZE];
+  CHECK(WPAKey::derivePMK("password","IEEE",pmk));
+  CHECK(pmk[0] == 0xf4 && pmk[PMK_SIZE-1] == 0x2e);
+}
+
+static void testLimits() {
+  char hex[PMK_HEX_SIZE];
+  CHECK(!WPAKey::derivePMK("short","IEEE",hex));                     // Passphrase under 8 characters
+  CHECK(!WPAKey::derivePMK("password","",hex));                      // Empty SSID
+  CHECK(!WPAKey::isPMK("password"));
+  CHECK(!WPAKey::isPMK("0123456789abcdef0123456789"));               // 26 hex WEP key is not a PMK
+  CHECK(!WPAKey::isPMK("g42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e"));
+}
+
+static void benchmark() {
+  const int runs = 20;
+  char      hex[PMK_HEX_SIZE];
+  auto      start = std::chrono::steady_clock::now();
+  for( int i=0; i<runs; i++ ) WPAKey::derivePMK("ThisIsAPassword","ThisIsASSID",hex);
+  double    ms = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("wpakey_test: %.2f ms per PMK on host (%d runs)\n",ms/runs,runs);
+}
+
+int main() {
+  testRFC6070();
+  testPMK();
+  testLimits();
+  benchmark();
+  return report("wpakey_test");
+}
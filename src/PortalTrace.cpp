@@ -0,0 +1,188 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#include "PortalTrace.h"
+#include <string.h>
+
+namespace lsc {
+
+void PortalTrace::begin(uint8_t* buffer, size_t size, unsigned long now) {
+  _buffer   = buffer;
+  _size     = (buffer != NULL ? size : 0);
+  _pos      = 0;
+  _mark     = 0;
+  _last     = now;
+  _pending  = now;
+  _status   = -1;
+  _overflow = false;
+  _enabled  = (_size > 0);
+}
+
+/**
+ *  Records are written at _mark and only become part of the trace on commit(), so a record that does not fit is dropped whole.
+ */
+bool PortalTrace::open(uint8_t type, unsigned long now) {
+  if( !_enabled ) return false;
+  _mark    = _pos;
+  _pending = now;
+  return putByte(type) && putVarint((uint32_t)(now - _last));
+}
+
+bool PortalTrace::putByte(uint8_t b) {
+  if( _mark >= _size ) {
+    _overflow = true;
+    _enabled  = false;
+    return false;
+  }
+  _buffer[_mark++] = b;
+  return true;
+}
+
+bool PortalTrace::putVarint(uint32_t v) {
+  while( v >= 0x80 ) {
+    if( !putByte((uint8_t)(v | 0x80)) ) return false;
+    v >>= 7;
+  }
+  return putByte((uint8_t)v);
+}
+
+bool PortalTrace::putString(const char* s) {
+  if( s == NULL ) s = "";
+  size_t len = strlen(s);
+  if( !putVarint((uint32_t)len) ) return false;
+  for( size_t i=0; i<=len; i++ ) {
+    if( !putByte((uint8_t)s[i]) ) return false;
+  }
+  return true;
+}
+
+void PortalTrace::request(unsigned long now, const char* uri, int argc, const char** names, const char** values) {
+  if( argc > TRACE_MAX_ARGS ) argc = TRACE_MAX_ARGS;
+  if( !open(TRACE_REQUEST,now) || !putString(uri) || !putByte((uint8_t)argc) ) return;
+  for( int i=0; i<argc; i++ ) {
+    if( !putString(names[i]) || !putString(values[i]) ) return;
+  }
+  commit();
+}
+
+void PortalTrace::status(unsigned long now, int status) {
+  if( status == _status ) return;
+  if( open(TRACE_STATUS,now) && putByte((uint8_t)status) ) {
+    _status = status;
+    commit();
+  }
+}
+
+void PortalTrace::scan(unsigned long now, int count) {
+  if( open(TRACE_SCAN,now) && putByte((uint8_t)count) ) commit();
+}
+
+void PortalTrace::scanResult(unsigned long now, int rssi, int channel, const char* ssid) {
+  if( open(TRACE_SCAN_RESULT,now) && putByte((uint8_t)(int8_t)rssi) && putByte((uint8_t)channel) && putString(ssid) ) commit();
+}
+
+bool PortalTrace::getVarint(const uint8_t* data, size_t len, size_t& pos, uint32_t& v) {
+  v = 0;
+  for( int shift=0; shift<35; shift+=7 ) {
+    if( pos >= len ) return false;
+    uint8_t b = data[pos++];
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if( (b & 0x80) == 0 ) return true;
+  }
+  return false;
+}
+
+bool PortalTrace::getString(const uint8_t* data, size_t len, size_t& pos, const char*& s) {
+  uint32_t n = 0;
+  if( !getVarint(data,len,pos,n) || n >= len - pos || data[pos+n] != 0 ) return false;
+  s = (const char*)(data + pos);
+  pos += n + 1;
+  return true;
+}
+
+/**
+ *  Replay is deterministic: records are delivered strictly in order with their recorded timestamps, whether or not 
+ *  realtime pacing is requested. Without pacing the trace runs as fast as the listener can consume it.
+ */
+int PortalTrace::replay(const uint8_t* data, size_t len, TraceListener* listener, bool realtime) {
+  if( data == NULL || listener == NULL ) return -1;
+  size_t        pos   = 0;
+  unsigned long at    = 0;
+  int           count = 0;
+  while( pos < len ) {
+    uint8_t  type = data[pos++];
+    uint32_t dt   = 0;
+    if( !getVarint(data,len,pos,dt) ) return -1;
+    at += dt;
+    if( realtime ) listener->pace(at);
+    switch( type ) {
+      case TRACE_REQUEST: {
+        const char* uri = NULL;
+        const char* names[TRACE_MAX_ARGS];
+        const char* values[TRACE_MAX_ARGS];
+        if( !getString(data,len,pos,uri) || pos >= len ) return -1;
+        int argc = data[pos++];
+        if( argc > TRACE_MAX_ARGS ) return -1;
+        for( int i=0; i<argc; i++ ) {
+          if( !getString(data,len,pos,names[i]) || !getString(data,len,pos,values[i]) ) return -1;
+        }
+        listener->onRequest(at,uri,argc,names,values);
+        break;
+      }
+      case TRACE_STATUS:
+        if( pos >= len ) return -1;
+        listener->onStatus(at,data[pos++]);
+        break;
+      case TRACE_SCAN:
+        if( pos >= len ) return -1;
+        listener->onScan(at,data[pos++]);
+        break;
+      case TRACE_SCAN_RESULT: {
+        const char* ssid = NULL;
+        if( pos + 2 > len ) return -1;
+        int rssi    = (int8_t)data[pos++];
+        int channel = data[pos++];
+        if( !getString(data,len,pos,ssid) ) return -1;
+        listener->onScanResult(at,rssi,channel,ssid);
+        break;
+      }
+      default:
+        return -1;
+    }
+    count++;
+  }
+  return count;
+}
+
+/**
+ *  The header is decoded byte by byte so a dump written on a little endian device replays on any host
+ */
+int PortalTrace::replayDump(const uint8_t* data, size_t len, TraceListener* listener, bool realtime) {
+  if( data == NULL || len < TRACE_HEADER ) return -1;
+  uint32_t magic  = (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+  uint32_t length = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+  if( magic != TRACE_MAGIC || length > len - TRACE_HEADER ) return -1;
+  return replay(data + TRACE_HEADER,length,listener,realtime);
+}
+
+} // End of namespace lsc
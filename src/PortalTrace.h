@@ -0,0 +1,133 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#ifndef PORTAL_TRACE_H
+#define PORTAL_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace lsc {
+
+#define TRACE_MAGIC      0x31545057      // "WPT1" little endian
+#define TRACE_HEADER     8               // Magic and length, both 32 bit little endian
+#define TRACE_MAX_ARGS   8
+
+/**
+ *  Trace record types
+ */
+typedef enum TraceRecord {
+  TRACE_REQUEST = 1,                    // HTTP request: uri, argCount, then argCount name/value pairs
+  TRACE_STATUS,                         // WiFi.status() transition
+  TRACE_SCAN,                           // Scan completed: number of results that follow
+  TRACE_SCAN_RESULT                     // One scan result: rssi, channel, ssid
+} TraceRecord;
+
+/**
+ *  Receives decoded records from PortalTrace::replay(). Timestamps are milliseconds relative to the start of the trace.
+ *  pace() is called before each record when replaying in real time, and may sleep until the given timestamp. Strings 
+ *  point into the trace buffer and are only valid for the duration of the call.
+ */
+class TraceListener {
+  public:
+  virtual ~TraceListener() {}
+  virtual void     pace(unsigned long /*at*/)                                                              {}
+  virtual void     onRequest(unsigned long /*at*/, const char* /*uri*/, int /*argc*/, const char** /*names*/, const char** /*values*/) {}
+  virtual void     onStatus(unsigned long /*at*/, int /*status*/)                                          {}
+  virtual void     onScan(unsigned long /*at*/, int /*count*/)                                             {}
+  virtual void     onScanResult(unsigned long /*at*/, int /*rssi*/, int /*channel*/, const char* /*ssid*/) {}
+};
+
+/**
+ *  PortalTrace records a portal session into a caller supplied buffer as a compact binary trace. Each record is a type byte,
+ *  a varint millisecond delta from the previous record, and a type specific payload. Strings are stored as a varint length 
+ *  followed by the characters and a terminating NUL, so replay can hand them out without copying. When the buffer fills,
+ *  recording stops at the last complete record and overflow() is set.
+ */
+class PortalTrace {
+  public:
+  PortalTrace() {}
+
+  void             begin(uint8_t* buffer, size_t size, unsigned long now);
+  void             end()                                   {_enabled = false;}
+  bool             enabled()                               {return _enabled;}
+  bool             overflow()                              {return _overflow;}
+  const uint8_t*   data()                                  {return _buffer;}
+  size_t           length()                                {return _pos;}
+
+/**
+ *  Recording, now is the current millis()
+ */
+  void             request(unsigned long now, const char* uri, int argc, const char** names, const char** values);
+  void             status(unsigned long now, int status);  // Only recorded when status changes
+  void             scan(unsigned long now, int count);
+  void             scanResult(unsigned long now, int rssi, int channel, const char* ssid);
+
+/**
+ *  Write header (magic and length) followed by trace data with the supplied function, e.g. Serial.write
+ */
+  template<typename W> void write(W writer) {
+    uint8_t hdr[TRACE_HEADER];
+    for( int i=0; i<4; i++ ) {
+      hdr[i]   = (uint8_t)((uint32_t)TRACE_MAGIC >> (8*i));
+      hdr[i+4] = (uint8_t)((uint32_t)_pos >> (8*i));
+    }
+    writer((const uint8_t*)hdr,sizeof(hdr));
+    if( _pos > 0 ) writer(_buffer,_pos);
+  }
+
+/**
+ *  Decode a trace and deliver its records to listener. If realtime is true, listener->pace() is called before each record.
+ *  Returns the number of records replayed, or -1 if the trace is malformed.
+ */
+  static int       replay(const uint8_t* data, size_t len, TraceListener* listener, bool realtime = false);
+
+/**
+ *  Replay a trace as produced by write(), checking the magic and length header first. Returns -1 if the header is missing 
+ *  or the length does not fit in len.
+ */
+  static int       replayDump(const uint8_t* data, size_t len, TraceListener* listener, bool realtime = false);
+
+  private:
+  bool             open(uint8_t type, unsigned long now);
+  void             commit()                                {_pos = _mark; _last = _pending;}
+  bool             putByte(uint8_t b);
+  bool             putVarint(uint32_t v);
+  bool             putString(const char* s);
+  static bool getVarint(const uint8_t* data, size_t len, size_t& pos, uint32_t& v);
+  static bool getString(const uint8_t* data, size_t len, size_t& pos, const char*& s);
+
+  uint8_t*         _buffer   = NULL;
+  size_t           _size     = 0;
+  size_t           _pos      = 0;
+  size_t           _mark     = 0;
+  unsigned long    _last     = 0;
+  unsigned long    _pending  = 0;
+  int              _status   = -1;
+  bool             _enabled  = false;
+  bool             _overflow = false;
+};
+
+} // End of namespace lsc
+
+#endif
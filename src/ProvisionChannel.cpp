@@ -0,0 +1,78 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#include "ProvisionChannel.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace lsc {
+
+bool ProvisionChannel::feed(int c) {
+  if( c == '\r' ) return false;
+  if( c == '\n' ) {
+    _line[_len] = '\0';
+    if( _len > 0 || _overflow ) return true;
+    return false;
+  }
+  if( _len < sizeof(_line) - 1 ) _line[_len++] = (char)c;
+  else _overflow = true;
+  return false;
+}
+
+void ProvisionChannel::process(const Connector& connect, char* reply, size_t size) {
+  command(_line,_overflow,connect,reply,size);
+  _len      = 0;
+  _overflow = false;
+}
+
+bool ProvisionChannel::frame(char* line, size_t n, bool overflow) {
+  line[n] = '\0';
+  char* eol = strpbrk(line,"\r\n");
+  if( eol != NULL ) *eol = '\0';
+  return overflow || strlen(line) > PROVISION_LINE_SIZE - 1;
+}
+
+void ProvisionChannel::ack(const char* ssid, char* reply, size_t size) {
+  snprintf(reply,size,"ACK\t%s\n",ssid);
+}
+
+void ProvisionChannel::command(char* line, bool overflow, const Connector& connect, char* reply, size_t size) {
+  if( overflow ) {
+    snprintf(reply,size,"ERR\tline too long\n");
+    return;
+  }
+  char* ssid = NULL;
+  char* psk  = NULL;
+  if( strncmp(line,"WIFI\t",5) == 0 ) {
+    ssid = line + 5;
+    psk  = strchr(ssid,'\t');
+    if( psk != NULL ) *psk++ = '\0';
+  }
+  if( ssid == NULL || psk == NULL || strlen(ssid) == 0 || strlen(psk) == 0 ) {
+    snprintf(reply,size,"ERR\tbad command\n");
+    return;
+  }
+  connect(ssid,psk,reply,size);
+}
+
+} // End of namespace lsc
@@ -0,0 +1,128 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#ifndef PROVISION_CHANNEL_H
+#define PROVISION_CHANNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <functional>
+
+namespace lsc {
+
+#define PROVISION_LINE_SIZE     160
+
+/**
+ *  ProvisionChannel parses headless provisioning commands of the form
+ *      WIFI<TAB>ssid<TAB>psk<LF>
+ *  and formats the single line reply. Input is fed a character at a time so a Stream can be polled without blocking, or
+ *  taken a datagram at a time from UDP. On either channel a command longer than PROVISION_LINE_SIZE-1 characters, not 
+ *  counting its CR/LF, is discarded whole and answered with ERR rather than truncated. The connection attempt itself is 
+ *  made by the Connector, which writes OK or FAIL into reply.
+ */
+class ProvisionChannel {
+  public:
+  typedef std::function<void(const char* ssid, const char* psk, char* reply, size_t size)> Connector;
+
+  ProvisionChannel() {}
+
+/**
+ *  Feed one character, returns true when a line is complete and ready for process()
+ */
+  bool             feed(int c);
+
+/**
+ *  Process the completed line, writing the reply. The line buffer is reset for the next command.
+ */
+  void             process(const Connector& connect, char* reply, size_t size);
+
+/**
+ *  Parse and execute a single command line. overflow marks a line that did not fit its buffer.
+ */
+  static void      command(char* line, bool overflow, const Connector& connect, char* reply, size_t size);
+
+/**
+ *  Read whatever stream has available and execute at most one complete command, printing its reply to stream.
+ *  Returns true if a command was executed.
+ */
+  template<typename S> bool poll(S& stream, const Connector& connect) {
+    while( stream.available() > 0 ) {
+      int c = stream.read();
+      if( c < 0 ) break;
+      if( feed(c) ) {
+        char reply[PROVISION_LINE_SIZE];
+        process(connect,reply,sizeof(reply));
+        stream.print(reply);
+        return true;
+      }
+    }
+    return false;
+  }
+
+/**
+ *  Execute at most one command received as a single datagram on udp, which provides the WiFiUDP calls parsePacket(), 
+ *  read(buffer,size), remoteIP(), remotePort(), beginPacket(ip,port), write(buffer,size) and endPacket(). A successful 
+ *  join can move the softAP channel and drop the sender, so a well formed command is acknowledged with ACK<TAB>ssid 
+ *  before connect is called, and the reply is sent after it on a best effort basis. Returns true if a datagram was handled.
+ */
+  template<typename U> static bool pollDatagram(U& udp, const Connector& connect) {
+    int len = udp.parsePacket();
+    if( len <= 0 ) return false;
+    char     line[PROVISION_LINE_SIZE + 2];                  // Room for a trailing CR/LF
+    char     reply[PROVISION_LINE_SIZE];
+    auto     remote   = udp.remoteIP();
+    uint16_t port     = udp.remotePort();
+    bool     overflow = (len > (int)sizeof(line) - 1);
+    int      n        = (overflow ? 0 : udp.read((unsigned char*)line,sizeof(line)-1));
+    overflow = frame(line,(n > 0 ? n : 0),overflow);
+    command(line,overflow,[&](const char* ssid, const char* psk, char* r, size_t size) {
+      ack(ssid,r,size);
+      send(udp,remote,port,r);
+      connect(ssid,psk,r,size);
+    },reply,sizeof(reply));
+    send(udp,remote,port,reply);
+    return true;
+  }
+
+  private:
+/**
+ *  Terminate the n bytes of a datagram in line at its first CR/LF, returns true if what remains is too long
+ */
+  static bool      frame(char* line, size_t n, bool overflow);
+  static void      ack(const char* ssid, char* reply, size_t size);
+
+  template<typename U, typename A> static void send(U& udp, const A& ip, uint16_t port, const char* msg) {
+    udp.beginPacket(ip,port);
+    udp.write((const uint8_t*)msg,strlen(msg));
+    udp.endPacket();
+  }
+
+  char             _line[PROVISION_LINE_SIZE];
+  size_t           _len      = 0;
+  bool             _overflow = false;
+};
+
+} // End of namespace lsc
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#include "WPAKey.h"
+#include <string.h>
+
+namespace lsc {
+
+#define SHA1_BLOCK   64
+#define SHA1_DIGEST  20
+
+/**
+ *  Minimal SHA1 working on a single state. PBKDF2 only ever hashes one block past the precomputed HMAC pad states, so
+ *  the state is copied and finished directly rather than going through a general update/final interface.
+ */
+typedef struct SHA1State {
+  uint32_t h[5];
+} SHA1State;
+
+static inline uint32_t rol(uint32_t v, int n) {return (v << n) | (v >> (32 - n));}
+
+static void sha1Init(SHA1State& s) {
+  s.h[0] = 0x67452301; s.h[1] = 0xEFCDAB89; s.h[2] = 0x98BADCFE; s.h[3] = 0x10325476; s.h[4] = 0xC3D2E1F0;
+}
+
+static void sha1Block(SHA1State& s, const uint8_t* block) {
+  uint32_t w[16];
+  for( int i=0; i<16; i++ ) w[i] = ((uint32_t)block[4*i] << 24) | ((uint32_t)block[4*i+1] << 16) | ((uint32_t)block[4*i+2] << 8) | block[4*i+3];
+  uint32_t a = s.h[0], b = s.h[1], c = s.h[2], d = s.h[3], e = s.h[4];
+  for( int i=0; i<80; i++ ) {
+    uint32_t f, k;
+    if( i >= 16 ) w[i & 15] = rol(w[(i+13) & 15] ^ w[(i+8) & 15] ^ w[(i+2) & 15] ^ w[i & 15],1);
+    if( i < 20 )      {f = (b & c) | (~b & d);          k = 0x5A827999;}
+    else if( i < 40 ) {f = b ^ c ^ d;                   k = 0x6ED9EBA1;}
+    else if( i < 60 ) {f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;}
+    else              {f = b ^ c ^ d;                   k = 0xCA62C1D6;}
+    uint32_t t = rol(a,5) + f + e + k + w[i & 15];
+    e = d; d = c; c = rol(b,30); b = a; a = t;
+  }
+  s.h[0] += a; s.h[1] += b; s.h[2] += c; s.h[3] += d; s.h[4] += e;
+}
+
+/**
+ *  Hash len bytes of data following prefix bytes already absorbed into s (a multiple of SHA1_BLOCK)
+ */
+static void sha1Finish(SHA1State s, size_t prefix, const uint8_t* data, size_t len, uint8_t digest[SHA1_DIGEST]) {
+  uint8_t  block[SHA1_BLOCK];
+  uint64_t bits = (uint64_t)(prefix + len) * 8;
+  while( len >= SHA1_BLOCK ) {
+    sha1Block(s,data);
+    data += SHA1_BLOCK;
+    len  -= SHA1_BLOCK;
+  }
+  memcpy(block,data,len);
+  block[len++] = 0x80;
+  if( len > SHA1_BLOCK - 8 ) {
+    memset(block + len,0,SHA1_BLOCK - len);
+    sha1Block(s,block);
+    len = 0;
+  }
+  memset(block + len,0,SHA1_BLOCK - 8 - len);
+  for( int i=0; i<8; i++ ) block[SHA1_BLOCK - 1 - i] = (uint8_t)(bits >> (8*i));
+  sha1Block(s,block);
+  for( int i=0; i<5; i++ ) {
+    digest[4*i]   = (uint8_t)(s.h[i] >> 24);
+    digest[4*i+1] = (uint8_t)(s.h[i] >> 16);
+    digest[4*i+2] = (uint8_t)(s.h[i] >> 8);
+    digest[4*i+3] = (uint8_t)(s.h[i]);
+  }
+}
+
+/**
+ *  The HMAC inner and outer pad states depend only on the password, so they are computed once and each of the 
+ *  2*iterations HMACs costs two compressions instead of four.
+ */
+void WPAKey::pbkdf2(const uint8_t* password, size_t passwordLen, const uint8_t* salt, size_t saltLen, 
+                    uint32_t iterations, uint8_t* out, size_t outLen) {
+  uint8_t   key[SHA1_BLOCK];
+  uint8_t   pad[SHA1_BLOCK];
+  SHA1State inner, outer;
+
+  memset(key,0,sizeof(key));
+  if( passwordLen > SHA1_BLOCK ) {
+    SHA1State s;
+    sha1Init(s);
+    sha1Finish(s,0,password,passwordLen,key);
+  }
+  else memcpy(key,password,passwordLen);
+  for( int i=0; i<SHA1_BLOCK; i++ ) pad[i] = key[i] ^ 0x36;
+  sha1Init(inner);
+  sha1Block(inner,pad);
+  for( int i=0; i<SHA1_BLOCK; i++ ) pad[i] = key[i] ^ 0x5C;
+  sha1Init(outer);
+  sha1Block(outer,pad);
+
+  uint8_t  u[SHA1_DIGEST];
+  uint8_t  t[SHA1_DIGEST];
+  uint8_t  msg[SHA1_BLOCK];
+  uint32_t blockIndex = 1;
+  while( outLen > 0 ) {
+
+/**
+ *   U1 = HMAC(password, salt || INT(i)), salt longer than a block is hashed through the inner state in one pass
+ */
+    uint8_t  first[SHA1_BLOCK + 4];
+    size_t   firstLen = 0;
+    uint8_t  idx[4] = {(uint8_t)(blockIndex >> 24),(uint8_t)(blockIndex >> 16),(uint8_t)(blockIndex >> 8),(uint8_t)blockIndex};
+    if( saltLen <= SHA1_BLOCK ) {
+      memcpy(first,salt,saltLen);
+      memcpy(first + saltLen,idx,4);
+      firstLen = saltLen + 4;
+      sha1Finish(inner,SHA1_BLOCK,first,firstLen,msg);
+    }
+    else {
+      SHA1State s = inner;
+      size_t    whole = saltLen - (saltLen % SHA1_BLOCK);
+      for( size_t i=0; i<whole; i+=SHA1_BLOCK ) sha1Block(s,salt + i);
+      firstLen = saltLen - whole;
+      memcpy(first,salt + whole,firstLen);
+      memcpy(first + firstLen,idx,4);
+      sha1Finish(s,SHA1_BLOCK + whole,first,firstLen + 4,msg);
+    }
+    sha1Finish(outer,SHA1_BLOCK,msg,SHA1_DIGEST,u);
+    memcpy(t,u,SHA1_DIGEST);
+
+    for( uint32_t n=1; n<iterations; n++ ) {
+      sha1Finish(inner,SHA1_BLOCK,u,SHA1_DIGEST,msg);
+      sha1Finish(outer,SHA1_BLOCK,msg,SHA1_DIGEST,u);
+      for( int i=0; i<SHA1_DIGEST; i++ ) t[i] ^= u[i];
+    }
+
+    size_t n = (outLen < SHA1_DIGEST ? outLen : SHA1_DIGEST);
+    memcpy(out,t,n);
+    out    += n;
+    outLen -= n;
+    blockIndex++;
+  }
+}
+
+bool WPAKey::derivePMK(const char* passphrase, const char* ssid, uint8_t pmk[PMK_SIZE]) {
+  if( passphrase == NULL || ssid == NULL ) return false;
+  size_t plen = strlen(passphrase);
+  size_t slen = strlen(ssid);
+  if( plen < 8 || plen > 63 || slen < 1 || slen > 32 ) return false;
+  pbkdf2((const uint8_t*)passphrase,plen,(const uint8_t*)ssid,slen,PMK_ITERATIONS,pmk,PMK_SIZE);
+  return true;
+}
+
+bool WPAKey::derivePMK(const char* passphrase, const char* ssid, char hex[PMK_HEX_SIZE]) {
+  static const char digits[] = "0123456789abcdef";
+  uint8_t pmk[PMK_SIZE];
+  if( !derivePMK(passphrase,ssid,pmk) ) return false;
+  for( int i=0; i<PMK_SIZE; i++ ) {
+    hex[2*i]   = digits[pmk[i] >> 4];
+    hex[2*i+1] = digits[pmk[i] & 0x0F];
+  }
+  hex[2*PMK_SIZE] = '\0';
+  memset(pmk,0,sizeof(pmk));
+  return true;
+}
+
+bool WPAKey::isPMK(const char* psk) {
+  if( psk == NULL || strlen(psk) != 2*PMK_SIZE ) return false;
+  for( int i=0; i<2*PMK_SIZE; i++ ) {
+    char c = psk[i];
+    if( !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) ) return false;
+  }
+  return true;
+}
+
+} // End of namespace lsc
@@ -0,0 +1,71 @@
+/**
+ * 
+ *  WiFiPortal Library
+ *  Copyright (C) 2023  Daniel L Toth
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published 
+ *  by the Free Software Foundation, either version 3 of the License, or any 
+ *  later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *  
+ *  The author can be contacted at dan@leelanausoftware.com  
+ *
+ */
+ 
+ 
+#ifndef WPA_KEY_H
+#define WPA_KEY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace lsc {
+
+#define PMK_SIZE          32
+#define PMK_HEX_SIZE      (2*PMK_SIZE + 1)
+#define PMK_ITERATIONS    4096
+
+/**
+ *  WPAKey derives the WPA2 pairwise master key from a passphrase, PBKDF2-HMAC-SHA1(passphrase, ssid, 4096, 32), so it can 
+ *  be handed to WiFi as a 64 character hex PSK. Both ESP8266 and ESP32 use a 64 character hex PSK directly, skipping 
+ *  the derivation on every subsequent connection.
+ */
+class WPAKey {
+  public:
+
+/**
+ *  Derive the 32 byte PMK. Returns false if passphrase is not 8 to 63 characters or ssid is not 1 to 32 characters.
+ */
+  static bool      derivePMK(const char* passphrase, const char* ssid, uint8_t pmk[PMK_SIZE]);
+
+/**
+ *  Derive the PMK and format as a NUL terminated 64 character lower case hex string
+ */
+  static bool      derivePMK(const char* passphrase, const char* ssid, char hex[PMK_HEX_SIZE]);
+
+/**
+ *  General PBKDF2-HMAC-SHA1
+ */
+  static void      pbkdf2(const uint8_t* password, size_t passwordLen, const uint8_t* salt, size_t saltLen, 
+                          uint32_t iterations, uint8_t* out, size_t outLen);
+
+/**
+ *  True if psk is already a 64 character hex PMK
+ */
+  static bool      isPMK(const char* psk);
+
+  private:
+  WPAKey() {}
+};
+
+} // End of namespace lsc
+
+#endif
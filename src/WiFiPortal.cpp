@@ -23,6 +23,14 @@
 #include "WiFiPortal.h"
 #include "PortalProgmem.h"
 
+#ifdef ESP8266
+extern "C" {
+#include <user_interface.h>
+}
+#elif defined(ESP32)
+#include <esp_wifi.h>
+#endif
+
 namespace lsc {
 
 #define DISPLAY_SIZE 1280
@@ -35,6 +43,13 @@ namespace lsc {
 const char APwifi_button[]      PROGMEM = "<a href=\"%s?ssid=%s\" class=\"scaled apButton\">%s</a>";                                                     // apForm path, SSID, SSID
 const char APcancel_button[]    PROGMEM = "<br><div align=\"center\"><a href=\"%s\" class=\"medium apButton\">"
                                                                      "Cancel</a></div>";                                                                 // Cancel path
+/**
+ *   URIs requested by phone and desktop OS connectivity checks. These are answered with an empty 204.
+ */
+const char* const probeURIs[] = {"/generate_204","/gen_204","/hotspot-detect.html","/library/test/success.html","/connecttest.txt",
+                                 "/ncsi.txt","/success.txt","/canonical.html","/redirect","/mobile/status.php","/favicon.ico",NULL};
+const char NotFound_page[]      PROGMEM = "<!DOCTYPE html><html><body style=\"font-family: Arial\"><h1 align=\"center\">OOPS! Not Found!</h1></body></html>";
+
 const char AP_success[]         PROGMEM = "<!DOCTYPE html>"
                                              "<html>"
                                                 "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"
@@ -63,15 +78,26 @@ void WiFiPortal::updateMDNS() {
 
 /**
  *   ConnectionState remains CNX_DISCONNECTED until the portal returns from a successful connection to an SSID (in finishConnect()),
- *   at which point the state is set to CNX_FINISHED.
+ *   at which point the state is set to CNX_FINISHED. Once CNX_CONNECTED, the link is supervised if supervise() is true, moving 
+ *   to CNX_RECONNECTING on link loss and back to CNX_DISCONNECTED if the portal is re-opened.
  */
 int WiFiPortal::connectWiFi() {
+  if( threaded() ) return getConnectionState();
+  return serviceWiFi();
+}
+
+int WiFiPortal::serviceWiFi() {
+  traceStatus();
+  uint8_t request = _portalRequest.exchange(PORTAL_REQUEST_NONE);
+  if( request == PORTAL_REQUEST_OPEN ) reopenPortal();
+  else if( request == PORTAL_REQUEST_CLOSE ) shutdownPortal();
   if( finishedState() ) {
     if(loggingLevel(FINE)) Serial.printf_P(PSTR("WiFiPortal::connectWiFi: Connecting to %s\n"),ssid());
     if( WiFi.status() == WL_CONNECTED ) {
       setConnectionState(CNX_CONNECTED);
       if(loggingLevel(FINE)) Serial.printf_P(PSTR("connectWiFi: Connection to %s SUCCESSFUL\n"),ssid());
       finish();
+      linkUp();
     }
 /**
  *   Should NOT happen   
@@ -84,21 +110,566 @@ int WiFiPortal::connectWiFi() {
       setConnectionState(CNX_DISCONNECTED);
     }
   }
+  else if( connectedState() || reconnectingState() ) {
+    if( roam() ) monitorRoam();
+    if( supervise() ) superviseLink();
+  }
   else {
-    updateMDNS();
-    _server.handleClient();
+    if( portalOpen() ) {
+      updateMDNS();
+      _tickCost = 0;
+      for( unsigned int i=0; i<requestBudget(); i++ ) {
+        unsigned int spent = _tickCost;
+        _server.handleClient();
+        if( _tickCost == spent || _tickCost >= requestBudget() ) break;
+      }
+    }
+    pollProvision();
+    if( disconnectedState() ) portalLifecycle();
   }
   return getConnectionState();
 }
 
+/**
+ *   Single writer side of the SSID sequence lock. Words are packed little end first and zero padded, so a reader
+ *   always finds a terminator within SSID_SIZE bytes.
+ */
+void WiFiPortal::setSSID(String ssid) {
+  if( _ssid == ssid ) return;
+  _ssid = ssid;
+  char buf[SSID_WORDS*4] = {0};
+  strncpy(buf,_ssid.c_str(),SSID_SIZE-1);
+  uint32_t seq = _ssidSeq.load(std::memory_order_relaxed);
+  _ssidSeq.store(seq+1,std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for( int i=0; i<SSID_WORDS; i++ ) {
+    uint32_t w = (uint32_t)(uint8_t)buf[4*i] | ((uint32_t)(uint8_t)buf[4*i+1] << 8) | 
+                 ((uint32_t)(uint8_t)buf[4*i+2] << 16) | ((uint32_t)(uint8_t)buf[4*i+3] << 24);
+    _ssidWords[i].store(w,std::memory_order_relaxed);
+  }
+  _ssidSeq.store(seq+2,std::memory_order_release);
+}
+
+/**
+ *   Reader side of the SSID sequence lock. The copy is retried while a write is in progress (odd sequence) or if the
+ *   sequence moved during the copy. Output is truncated to size and always terminated.
+ *   On ESP32 a failed pass blocks for a tick rather than spinning, since the reader may have preempted the portal task in
+ *   the middle of a write and the writer must be allowed to run. Elsewhere the writer is the caller's own loop.
+ */
+boolean WiFiPortal::ssid(char* out, size_t size) {
+  if( out == NULL || size == 0 ) return false;
+  uint32_t words[SSID_WORDS];
+  for(;;) {
+    uint32_t seq = _ssidSeq.load(std::memory_order_acquire);
+    if( (seq & 1) == 0 ) {
+      for( int i=0; i<SSID_WORDS; i++ ) words[i] = _ssidWords[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if( _ssidSeq.load(std::memory_order_relaxed) == seq ) break;
+    }
+#ifdef ESP32
+    vTaskDelay(1);
+#endif
+  }
+  size_t n = 0;
+  for( ; n<size-1 && n<SSID_WORDS*4; n++ ) {
+    out[n] = (char)(words[n/4] >> (8*(n%4)));
+    if( out[n] == '\0' ) break;
+  }
+  out[n] = '\0';
+  return out[0] != '\0';
+}
+
+/**
+ *   Transitions are dropped rather than blocking the portal if the application is not draining the queue
+ */
+void WiFiPortal::setConnectionState(ConnectionState s) {
+  if( _state.load() == s ) return;
+  _state.store(s);
+  uint8_t head = _eventHead.load();
+  uint8_t next = (head + 1) % PORTAL_EVENTS;
+  if( next != _eventTail.load() ) {
+    _events[head] = s;
+    _eventHead.store(next);
+  }
+}
+
+boolean WiFiPortal::nextEvent(ConnectionState& state) {
+  uint8_t tail = _eventTail.load();
+  if( tail == _eventHead.load() ) return false;
+  state = _events[tail];
+  _eventTail.store((tail + 1) % PORTAL_EVENTS);
+  return true;
+}
+
+#ifdef ESP32
+/**
+ *   Portal servicing on its own task. The task yields for PORTAL_TASK_PERIOD ms between passes so it does not starve the
+ *   idle task on its core.
+ */
+boolean WiFiPortal::startTask(int core, uint32_t stack, UBaseType_t priority) {
+  while( threaded() && _stopTask.load() ) vTaskDelay(pdMS_TO_TICKS(PORTAL_TASK_PERIOD));  // Previous task still exiting
+  if( threaded() ) return true;
+  _stopTask.store(false);
+  _threaded.store(true);
+  if( xTaskCreatePinnedToCore(portalTask,"WiFiPortal",stack,this,priority,NULL,core) != pdPASS ) {
+    _threaded.store(false);
+    if( loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::startTask: Failed to create portal task\n"));
+    return false;
+  }
+  if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::startTask: Portal task started on core %d\n"),core);
+  return true;
+}
+
+void WiFiPortal::portalTask(void* arg) {
+  WiFiPortal* portal = (WiFiPortal*)arg;
+  while( !portal->_stopTask.load() ) {
+    portal->serviceWiFi();
+    vTaskDelay(pdMS_TO_TICKS(PORTAL_TASK_PERIOD));
+  }
+  portal->_threaded.store(false);
+  vTaskDelete(NULL);
+}
+#endif
+
+/**
+ *   Portal lifecycle. Background retries are only made while no client is on the softAP, since a station connection attempt
+ *   can move the softAP channel out from under a user. A retry is started with a transient begin() and checked on later passes,
+ *   so the loop is never held for cnxTimeout(). A failed /connect or provisioning attempt in the meantime has already stored
+ *   its own credentials, so the retried ones are written back when a retry succeeds and the next boot joins the same network.
+ */
+void WiFiPortal::portalLifecycle() {
+  unsigned long now      = millis();
+  int           stations = (portalOpen() ? WiFi.softAPgetStationNum() : 0);
+  if( stations > 0 ) _lastActivity = now;
+
+  if( _retrying ) {
+    if( WiFi.status() == WL_CONNECTED ) {
+      _retrying = false;
+      persistCredentials(_storedSSID,_storedPSK);
+      setSSID(_storedSSID);
+      if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::portalLifecycle: Connected to %s with stored credentials\n"),_storedSSID.c_str());
+      setConnectionState(CNX_FINISHED);
+      return;
+    }
+    if( now - _retryStart < (unsigned long)cnxTimeout() ) return;
+    _retrying = false;
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::portalLifecycle: Retry of %s failed with status %s\n"),_storedSSID.c_str(),StatusStrings::wifiStatus());
+    disconnectSTA();
+  }
+
+  if( portalOpen() ) {
+    if( portalIdle() > 0 && now - _lastActivity >= portalIdle() ) {
+      if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::portalLifecycle: No clients for %lu ms, closing portal\n"),portalIdle());
+      shutdownPortal();
+      return;
+    }
+  }
+  else if( (reopenInterval() > 0 && now - _closedAt >= reopenInterval()) || (_buttonPin >= 0 && digitalRead(_buttonPin) == _buttonLevel) ) {
+    reopenPortal();
+    return;
+  }
+
+  if( retryInterval() > 0 && _storedSSID.length() > 0 && stations == 0 && now - _lastRetry >= retryInterval() ) {
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::portalLifecycle: Retrying stored credentials for %s\n"),_storedSSID.c_str());
+    _lastRetry  = now;
+    _retryStart = now;
+    _retrying   = true;
+    beginTransient(_storedSSID,_storedPSK);
+  }
+}
+
+void WiFiPortal::saveCredentials() {
+  stationConfig(_storedSSID,_storedPSK,true);
+}
+
+/**
+ *   Read credentials from the station config rather than WiFi.SSID() and WiFi.psk(), which on ESP32 are empty unless
+ *   connected. Config fields are fixed size and not NUL terminated when full (a 64 character PMK fills the password), so
+ *   they are copied out with a length limit. On ESP8266 stored selects the flash config over the current one; ESP32 keeps
+ *   a single config.
+ */
+boolean WiFiPortal::stationConfig(String& ssid, String& psk, boolean stored) {
+  char sid[33];
+  char key[65];
+#ifdef ESP8266
+  struct station_config conf;
+  if( !(stored ? wifi_station_get_config_default(&conf) : wifi_station_get_config(&conf)) ) return false;
+  memcpy(sid,conf.ssid,sizeof(conf.ssid));
+  memcpy(key,conf.password,sizeof(conf.password));
+#elif defined(ESP32)
+  (void)stored;
+  wifi_config_t conf;
+  if( esp_wifi_get_config(WIFI_IF_STA,&conf) != ESP_OK ) return false;
+  memcpy(sid,conf.sta.ssid,sizeof(conf.sta.ssid));
+  memcpy(key,conf.sta.password,sizeof(conf.sta.password));
+#endif
+  sid[sizeof(sid)-1] = '\0';
+  key[sizeof(key)-1] = '\0';
+  ssid = sid;
+  psk  = key;
+  return true;
+}
+
+/**
+ *   openPortal() and closePortal() may be called from any task, so they only post a request. serviceWiFi() carries it out on
+ *   the task that owns the portal.
+ */
+void WiFiPortal::openPortal() {
+  _portalRequest.store(PORTAL_REQUEST_OPEN);
+}
+
+void WiFiPortal::closePortal() {
+  _portalRequest.store(PORTAL_REQUEST_CLOSE);
+}
+
+void WiFiPortal::reopenPortal() {
+  if( portalOpen() || !disconnectedState() ) return;
+  if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::reopenPortal: Re-opening portal on %s\n"),_apName);
+  startPortal();
+}
+
+/**
+ *   Shut down the softAP and Web server, leaving WiFi in WIFI_STA mode for background retries
+ */
+void WiFiPortal::shutdownPortal() {
+  if( !portalOpen() ) return;
+  _server.close();
+  if( _provPort != 0 ) _udp.stop();
+  stopMDNS();
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+  _portalOpen = false;
+  _closedAt   = millis();
+  if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::shutdownPortal: SoftAP %s and Web Server shut down\n"),_apName);
+}
+
+void WiFiPortal::portalButton(int pin, int activeLevel) {
+  _buttonPin   = pin;
+  _buttonLevel = activeLevel;
+  if( pin >= 0 ) pinMode(pin,(activeLevel == LOW ? INPUT_PULLUP : INPUT));
+}
+
+/**
+ *   Headless provisioning. Serial input is fed to the channel a character at a time so the loop never blocks waiting for a
+ *   line; a UDP command must arrive in a single datagram. Framing, ACK and replies are handled by ProvisionChannel.
+ */
+void WiFiPortal::pollProvision() {
+  if( _provStream != NULL ) {
+    _provChannel.poll(*_provStream,[this](const char* ssid, const char* psk, char* reply, size_t size) {
+      this->provision(ssid,psk,reply,size);
+    });
+  }
+  if( _provPort != 0 ) {
+    ProvisionChannel::pollDatagram(_udp,[this](const char* ssid, const char* psk, char* reply, size_t size) {
+      this->provision(ssid,psk,reply,size);
+    });
+  }
+}
+
+/**
+ *   Attempt a connection exactly as connect() does. On success the state is set to CNX_FINISHED, since there is no 
+ *   /finishConnect page to be fetched.
+ */
+void WiFiPortal::provision(const char* ssid, const char* psk, char* reply, size_t size) {
+  if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::provision: Attempting connection to %s\n"),ssid);
+  setConnectionState(CNX_DISCONNECTED);
+  setSSID(ssid);
+  if( attemptConnect(ssid,psk) == WL_CONNECTED ) {
+    snprintf(reply,size,"OK\t%s\t%s\n",ssid,WiFi.localIP().toString().c_str());
+    setConnectionState(CNX_FINISHED);
+  }
+  else snprintf(reply,size,"FAIL\t%s\t%s\n",ssid,StatusStrings::wifiStatus());
+}
+
+/**
+ *   Non-blocking link supervision. On link loss, reconnect attempts are spaced with exponential backoff and "equal jitter"
+ *   (half the interval fixed, half random) so a building full of devices does not hammer a rebooting router in lock step.
+ *   The first attempt targets the last BSSID and channel, which skips the scan when the same AP comes back.
+ */
+void WiFiPortal::superviseLink() {
+  unsigned long now = millis();
+  if( WiFi.status() == WL_CONNECTED ) {
+    if( reconnectingState() ) {
+      endOutage(now);
+      setConnectionState(CNX_CONNECTED);
+      linkUp();
+      if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::superviseLink: Link to %s restored after %lu ms\n"),ssid(),_lastOutage);
+    }
+    return;
+  }
+
+/**
+ *  A re-association in progress from monitorRoam() does not count as an outage until it times out
+ */
+  if( _roamed ) return;
+
+  if( connectedState() ) linkLost(now);
+
+  if( now - _outageStart >= outageBudget() ) {
+    endOutage(now);
+    if( loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::superviseLink: Outage budget of %lu ms exceeded, re-opening portal\n"),outageBudget());
+    setConnectionState(CNX_DISCONNECTED);
+    saveCredentials();
+    startPortal();
+    return;
+  }
+
+/**
+ *  An attempt in progress is given cnxTimeout() to associate and get an address before another begin() is issued, unless
+ *  the driver has already given up on it
+ */
+  int status = WiFi.status();
+  if( _attempts > 0 && now - _attemptStart < (unsigned long)cnxTimeout() && status != WL_CONNECT_FAILED && status != WL_NO_SSID_AVAIL ) return;
+
+  if( (long)(now - _nextAttempt) >= 0 ) {
+    _attemptStart = now;
+    reconnect();
+    unsigned long backoff = minBackoff();
+    for( unsigned int i=1; i<_attempts && backoff < maxBackoff(); i++ ) backoff <<= 1;
+    if( backoff > maxBackoff() ) backoff = maxBackoff();
+    backoff = backoff/2 + random(backoff/2 + 1);
+    _nextAttempt = now + backoff;
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::superviseLink: Attempt %u, next attempt in %lu ms\n"),_attempts,backoff);
+  }
+}
+
+/**
+ *   The first attempt of an outage uses the saved BSSID and channel, subsequent attempts let the driver pick the AP. 
+ *   All attempts are transient so stored config is neither pinned to a BSSID nor rewritten.
+ */
+void WiFiPortal::reconnect() {
+  String sid = (hasSSID() ? _ssid : WiFi.SSID());
+  if( _attempts == 0 && _hasBSSID ) {
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::reconnect: Targeted reconnect to %s on channel %d\n"),sid.c_str(),_channel);
+    beginTransient(sid,_linkPSK,_channel,_bssid);
+  }
+  else {
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::reconnect: Reconnecting to %s\n"),sid.c_str());
+    beginTransient(sid,_linkPSK);
+  }
+  _attempts++;
+}
+
+/**
+ *   Start a connection without touching stored credentials.
+ *   ESP8266 reads the persistent flag on every begin(), so clearing it makes begin() set only the current config.
+ *   ESP32 only applies WiFi.persistent() at driver init, so the driver's storage mode is switched to RAM directly.
+ */
+void WiFiPortal::beginTransient(const String& ssid, const String& psk, int32_t channel, const uint8_t* bssid) {
+#ifdef ESP8266
+  WiFi.persistent(false);
+  WiFi.begin(ssid.c_str(),psk.c_str(),channel,bssid);
+  WiFi.persistent(true);
+#elif defined(ESP32)
+  esp_wifi_set_storage(WIFI_STORAGE_RAM);
+  WiFi.begin(ssid.c_str(),psk.c_str(),channel,bssid);
+  esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+#endif
+}
+
+/**
+ *   Store ssid and psk, with no BSSID, as the credentials used on the next boot, without starting a connection
+ */
+void WiFiPortal::persistCredentials(const String& ssid, const String& psk) {
+#ifdef ESP8266
+  struct station_config conf;
+  memset(&conf,0,sizeof(conf));
+  memcpy(conf.ssid,ssid.c_str(),(ssid.length() < sizeof(conf.ssid) ? ssid.length() : sizeof(conf.ssid)));
+  memcpy(conf.password,psk.c_str(),(psk.length() < sizeof(conf.password) ? psk.length() : sizeof(conf.password)));
+  conf.bssid_set = 0;
+  if( !wifi_station_set_config(&conf) && loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::persistCredentials: Failed to store credentials\n"));
+#elif defined(ESP32)
+  wifi_config_t conf;
+  memset(&conf,0,sizeof(conf));
+  memcpy(conf.sta.ssid,ssid.c_str(),(ssid.length() < sizeof(conf.sta.ssid) ? ssid.length() : sizeof(conf.sta.ssid)));
+  memcpy(conf.sta.password,psk.c_str(),(psk.length() < sizeof(conf.sta.password) ? psk.length() : sizeof(conf.sta.password)));
+  conf.sta.bssid_set = false;
+  esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+  if( esp_wifi_set_config(WIFI_IF_STA,&conf) != ESP_OK && loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::persistCredentials: Failed to store credentials\n"));
+#endif
+}
+
+/**
+ *   Strongest scan result advertising ssid, among the count results currently held by WiFi
+ */
+int WiFiPortal::bestNetwork(const String& ssid, int count) {
+  int best = -1;
+  for( int i=0; i<count; i++ ) {
+    if( WiFi.SSID(i) == ssid && (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best)) ) best = i;
+  }
+  return best;
+}
+
+/**
+ *   True if scan result index is a WPA or WPA2 personal network, including WPA2/WPA3 transition mode, where a PMK can stand
+ *   in for the passphrase. WPA3 only (SAE) and WEP networks need the key as entered.
+ */
+boolean WiFiPortal::pskNetwork(int index) {
+  int type = WiFi.encryptionType(index);
+#ifdef ESP8266
+  return (type == ENC_TYPE_TKIP || type == ENC_TYPE_CCMP || type == ENC_TYPE_AUTO);
+#elif defined(ESP32)
+  return (type == WIFI_AUTH_WPA_PSK || type == WIFI_AUTH_WPA2_PSK || type == WIFI_AUTH_WPA_WPA2_PSK || type == WIFI_AUTH_WPA2_WPA3_PSK);
+#else
+  return false;
+#endif
+}
+
+/**
+ *   Start a connection to the strongest BSSID for ssid. Scan results left by display() are used if younger than SCAN_CACHE,
+ *   otherwise a scan is made, so a BSSID and channel are never pinned from a stale scan. Credentials are stored without a BSSID through a config call that does not connect, so the next boot is not 
+ *   pinned to one AP, and the targeted begin() is transient. Only one association is started.
+ *   On WPA/WPA2 personal networks the passphrase is replaced with its PMK before WiFi sees it, so the derivation happens once
+ *   here instead of on every connection made from stored credentials. With no scan match the key is passed through as entered.
+ */
+void WiFiPortal::beginBest(const String& ssid, const String& psk) {
+  int count = WiFi.scanComplete();
+  if( count < 0 || millis() - _lastScan >= SCAN_CACHE ) {
+    WiFi.scanDelete();
+    count     = WiFi.scanNetworks();
+    _lastScan = millis();
+  }
+  int best = bestNetwork(ssid,count);
+  if( best >= 0 ) {
+    String key = psk;
+    if( pskNetwork(best) && !WPAKey::isPMK(psk.c_str()) ) {
+      char pmk[PMK_HEX_SIZE];
+      unsigned long start = millis();
+      if( WPAKey::derivePMK(psk.c_str(),ssid.c_str(),pmk) ) {
+        key = pmk;
+        if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::beginBest: PMK derived in %lu milliseconds\n"),millis()-start);
+      }
+    }
+    memcpy(_bssid,WiFi.BSSID(best),sizeof(_bssid));
+    _channel  = WiFi.channel(best);
+    _hasBSSID = true;
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::beginBest: Selected BSSID on channel %d with RSSI %d\n"),_channel,WiFi.RSSI(best));
+    persistCredentials(ssid,key);
+    beginTransient(ssid,key,_channel,_bssid);
+  }
+  else WiFi.begin(ssid.c_str(),psk.c_str());
+  WiFi.scanDelete();
+}
+
+/**
+ *   Low duty roaming monitor. Only RSSI is sampled unless the link is weak, and the scan is asynchronous so the loop is not
+ *   held for the ~2 seconds a scan takes.
+ */
+void WiFiPortal::monitorRoam() {
+  unsigned long now = millis();
+  if( _roamed ) {
+    if( WiFi.status() == WL_CONNECTED && memcmp(WiFi.BSSID(),_bssid,sizeof(_bssid)) == 0 ) {
+      _roamed = false;
+      linkUp();
+      if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::monitorRoam: Roamed to %s on channel %d\n"),WiFi.BSSIDstr().c_str(),_channel);
+    }
+    else if( now - _roamStart >= (unsigned long)cnxTimeout() ) {
+      _roamed = false;
+      if( loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::monitorRoam: Re-association timed out with status %s\n"),StatusStrings::wifiStatus());
+
+/**
+ *  _bssid and _channel still name the roam target; if the device stayed on an AP, record that one for the supervisor
+ */
+      if( WiFi.status() == WL_CONNECTED ) linkUp();
+    }
+    return;
+  }
+  if( !connectedState() || WiFi.status() != WL_CONNECTED ) {
+    if( _roamScan ) {WiFi.scanDelete(); _roamScan = false;}
+    return;
+  }
+  if( !_roamScan ) {
+    if( now - _roamSample < roamInterval() ) return;
+    _roamSample = now;
+    if( WiFi.RSSI() >= roamRSSI() || (_roamCount > 0 && now - _lastRoam < roamHoldoff()) ) return;
+    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::monitorRoam: RSSI %d below %d, scanning\n"),WiFi.RSSI(),roamRSSI());
+    WiFi.scanNetworks(true);
+    _roamScan = true;
+    return;
+  }
+  int count = WiFi.scanComplete();
+  if( count == WIFI_SCAN_RUNNING ) return;
+  _roamScan = false;
+  int best = bestNetwork(_ssid,count);
+  int rssi = WiFi.RSSI();
+  if( best >= 0 && memcmp(WiFi.BSSID(best),WiFi.BSSID(),sizeof(_bssid)) != 0 && WiFi.RSSI(best) >= rssi + roamHysteresis() ) {
+    if( loggingLevel(INFO) ) Serial.printf_P(PSTR("WiFiPortal::monitorRoam: Roaming from RSSI %d to %d\n"),rssi,WiFi.RSSI(best));
+    memcpy(_bssid,WiFi.BSSID(best),sizeof(_bssid));
+    _channel   = WiFi.channel(best);
+    _hasBSSID  = true;
+    beginTransient(_ssid,_linkPSK,_channel,_bssid);
+    _roamed    = true;
+    _roamStart = now;
+    _lastRoam  = now;
+    _roamCount++;
+  }
+  WiFi.scanDelete();
+}
+
+/**
+ *   The PSK is copied while the link is up, since reconnects happen after it is lost
+ */
+void WiFiPortal::linkUp() {
+  setSSID(WiFi.SSID());
+  String sid;
+  stationConfig(sid,_linkPSK,false);
+  uint8_t* bssid = WiFi.BSSID();
+  if( bssid != NULL ) {
+    memcpy(_bssid,bssid,sizeof(_bssid));
+    _channel  = WiFi.channel();
+    _hasBSSID = true;
+  }
+}
+
+void WiFiPortal::linkLost(unsigned long now) {
+  _outageCount++;
+  _outageStart = now;
+  _nextAttempt = now;
+  _attempts    = 0;
+  setConnectionState(CNX_RECONNECTING);
+  if( loggingLevel(WARNING) ) Serial.printf_P(PSTR("WiFiPortal::superviseLink: Link to %s lost with status %s\n"),ssid(),StatusStrings::wifiStatus());
+}
+
+void WiFiPortal::endOutage(unsigned long now) {
+  _lastOutage   = now - _outageStart;
+  _totalOutage += _lastOutage;
+  if( _lastOutage > _longestOutage ) _longestOutage = _lastOutage;
+}
+
+unsigned long WiFiPortal::outageDuration() {
+  return (reconnectingState() ? millis() - _outageStart : _lastOutage);
+}
+
+void WiFiPortal::resetOutageStats() {
+  _outageCount   = 0;
+  _lastOutage    = 0;
+  _longestOutage = 0;
+  _totalOutage   = 0;
+}
+
+/**
+ *   The driver's own auto reconnect would compete with the supervisor's attempts, so it is off while supervising
+ */
+void WiFiPortal::supervise(boolean flag) {
+  _supervise = flag;
+  WiFi.setAutoReconnect(!flag);
+}
+
+void WiFiPortal::reconnectBackoff(unsigned long minMs, unsigned long maxMs) {
+  _minBackoff = (minMs > 0 ? minMs : 1);
+  _maxBackoff = (maxMs > _minBackoff ? maxMs : _minBackoff);
+}
+
 int  WiFiPortal::attemptConnect(String ssid, String psk) {
+  _retrying = false;
   if( (WiFi.status() != WL_CONNECTED) ) {
     if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::attemptConnect: Connecting to %s with %s\n"),ssid.c_str(),psk.c_str());
-    WiFi.begin(ssid.c_str(),psk.c_str());
+    beginBest(ssid,psk);
     WiFi.setAutoConnect(true);
     long startTime = millis();
     WiFi.waitForConnectResult(cnxTimeout());
     long executionTime = millis() - startTime;
+    traceStatus();
     if( loggingLevel(FINE) ) {
       Serial.printf_P(PSTR("                            Connection sequence completed in %d milliseconds, WiFi status is %s\n"),executionTime,StatusStrings::wifiStatus());
     }
@@ -123,8 +694,10 @@ int  WiFiPortal::attemptConnect(String ssid, String psk) {
 }
 
 void WiFiPortal::finish() {
+  _portalOpen = false;
   _server.close();
   if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::finish: Internal Web Server closed\n"));  
+  if( _provPort != 0 ) _udp.stop();
   stopMDNS();
   if( loggingLevel(FINE) ) Serial.printf_P(PSTR("        mDNS stopped\n"));
      
@@ -161,24 +734,32 @@ void WiFiPortal::startPortal() {
     startMDNS();
     if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::startPortal: mDNS started on %s\n"),_apName);
     resetAP();
+    _portalOpen   = true;
+    _lastActivity = millis();
+    _lastRetry    = _lastActivity;
     
 /**
- *  Setup Web handlers
+ *  Setup Web handlers. The portal may be re-opened by the link supervisor, so handlers are only registered once.
  */
     _server.begin(SERVER_PORT);
+    if( _provPort != 0 ) {
+      _udp.begin(_provPort);
+      if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::startPortal: Provisioning listening on UDP port %d\n"),_provPort);
+    }
+    if( _portalStarted ) {
+      if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::startPortal: Internal Web Server restarted on %s:%d\n"),WiFi.softAPIP().toString().c_str(),SERVER_PORT);
+      return;
+    }
+    _portalStarted = true;
     _ctx.setup(&_server,WiFi.softAPIP(),SERVER_PORT);
     WebContext* ctxPtr = &_ctx;
     _server.addHandler(new RequestLogger(this));
-    _server.onNotFound([this]{
-         Serial.printf("OnNotFound:  %s NOT FOUND\n",this->_server.uri().c_str());
-         String content = String("<!DOCTYPE html><html><body style=\"font-family: Calibri\"><h1 align=\"center\"> OOPS! " + this->_server.uri() + " Not Found!</h1></body></html>");
-         this->_server.send(200, "text/html", content);
-      });
-    _ctx.on("/",[this](WebContext* svr){this->display(svr);});
-    _ctx.on("/connect",[this](WebContext* svr){this->connect(svr);});
-    _ctx.on("/finishConnect",[this](WebContext* svr){this->finishConnect(svr);});
-    _ctx.on("/styles.css",[ctxPtr](WebContext* ){ctxPtr->send_P(200, "text/css", styles_css);}); 
-    _ctx.on("/apForm",[this](WebContext* svr){this->apForm(svr);});
+    _server.onNotFound([this]{this->serveNotFound();});
+    _ctx.on("/",[this](WebContext* svr){if(this->serve(COST_SCAN)) this->display(svr);});
+    _ctx.on("/connect",[this](WebContext* svr){if(this->serve(COST_CONNECT)) this->connect(svr);});
+    _ctx.on("/finishConnect",[this](WebContext* svr){if(this->serve(COST_STATIC)) this->finishConnect(svr);});
+    _ctx.on("/styles.css",[this,ctxPtr](WebContext* ){if(this->serve(COST_STATIC)) ctxPtr->send_P(200, "text/css", styles_css);}); 
+    _ctx.on("/apForm",[this](WebContext* svr){if(this->serve(COST_STATIC)) this->apForm(svr);});
     if( loggingLevel(FINE) ) Serial.printf_P(PSTR("WiFiPortal::startPortal: Internal Web Server started on %s:%d\n"),WiFi.softAPIP().toString().c_str(),SERVER_PORT);
 }
 
@@ -210,6 +791,7 @@ void WiFiPortal::setup(const char* apName, const char* apPSK) {
      WiFi.begin();
      if( WiFi.waitForConnectResult(cnxTimeout()) != WL_CONNECTED ) {
        setConnectionState(CNX_DISCONNECTED);
+       saveCredentials();
        startPortal();
        if(loggingLevel(WARNING)) {
          if(hasSSID()) Serial.printf_P(PSTR("WiFiPortal::setup: Connection to %s FAILED\n"),ssid());
@@ -223,6 +805,7 @@ void WiFiPortal::setup(const char* apName, const char* apPSK) {
  *     actually started. If the softAP is not supposed to be disconnected, then set mode to WIFI_AP_STA and start up the softAP
  */
        setConnectionState(CNX_CONNECTED);
+       linkUp();
        if( !disconnectSoftAP() ) {
          Serial.printf("Setting mode to WIFI_AP_STA and starting softAP\n");
          WiFi.mode(WIFI_AP_STA);
@@ -247,7 +830,7 @@ void WiFiPortal::resetAP() {
   const char* tab   = "                    ";
 
   if( loggingLevel(FINE) ) Serial.printf_P(PSTR("%s Disconnecting from access point %s\n"),title,ssid());
-  WiFi.disconnect();
+  disconnectSTA();
   if( loggingLevel(FINE) ) Serial.printf_P(PSTR("%s Disconnecting Soft AP %s\n"),tab,_apName);
   WiFi.softAPdisconnect(true);
 
@@ -262,6 +845,16 @@ void WiFiPortal::resetAP() {
   else Serial.printf_P(PSTR("%s Portal FAILED to start Access Point %s!\n"),tab,_apName); 
 }
 
+/**
+ *   With persistence on, ESP8266 WiFi.disconnect() also erases the stored SSID and PSK. The portal can now be re-opened by
+ *   the link supervisor after an outage, so stored credentials must survive for the next boot cycle.
+ */
+void WiFiPortal::disconnectSTA() {
+  WiFi.persistent(false);
+  WiFi.disconnect();
+  WiFi.persistent(true);
+}
+
 /**
  *   Set WiFi autoconnect to false, so stored credentials will NOT be used on the next boot cycle.
  *   Must be called after WiFi.begin() to take effect.
@@ -270,6 +863,97 @@ void WiFiPortal::resetCredentials() {
     WiFi.setAutoConnect(false);
 }
 
+/**
+ *  Refill the client's bucket for the time elapsed since it was last seen, then charge cost if enough tokens remain.
+ *  Unknown clients take the free slot or the least recently seen one and start with a full bucket.
+ */
+boolean RateLimiter::admit(uint32_t ip, unsigned int cost, unsigned long now) {
+  unsigned long capacity = (unsigned long)_burst * 1000;
+  Bucket*       b        = NULL;
+  Bucket*       oldest   = &_clients[0];
+  for( int i=0; i<ADMIT_CLIENTS; i++ ) {
+    if( _clients[i].ip == ip ) {b = &_clients[i]; break;}
+    if( _clients[i].ip == 0 || (oldest->ip != 0 && now - _clients[i].last > now - oldest->last) ) oldest = &_clients[i];
+  }
+  if( b == NULL ) {
+    b         = oldest;
+    b->ip     = ip;
+    b->tokens = capacity;
+  }
+  else {
+    uint64_t refill = (uint64_t)(now - b->last) * _rate;
+    if( refill > capacity ) refill = capacity;
+    b->tokens = (capacity - b->tokens <= refill ? capacity : b->tokens + refill);
+  }
+  b->last = now;
+  if( b->tokens < (unsigned long)cost * 1000 ) return false;
+  b->tokens -= (unsigned long)cost * 1000;
+  return true;
+}
+
+/**
+ *  Refused requests get a bodyless 503 so a flooding client costs as little as possible, and are charged against the tick
+ *  budget at COST_STATIC, not at the cost of the route they asked for.
+ */
+boolean WiFiPortal::admit(RouteCost cost) {
+  if( !admission() || _limiter.admit((uint32_t)_server.client().remoteIP(),cost,millis()) ) {
+    _tickCost += cost;
+    return true;
+  }
+  _tickCost += COST_STATIC;
+  _rejected++;
+  if( loggingLevel(FINEST) ) Serial.printf_P(PSTR("WiFiPortal::admit: Refused %s from %s\n"),_server.uri().c_str(),_server.client().remoteIP().toString().c_str());
+  _server.sendHeader("Retry-After","1");
+  _server.send(503);
+  return false;
+}
+
+/**
+ *  Connectivity probes and unknown URIs are answered from flash without formatting a page.
+ */
+void WiFiPortal::serveNotFound() {
+  const String& uri = _server.uri();
+  traceRequest(uri);
+  for( int i=0; probeURIs[i] != NULL; i++ ) {
+    if( uri == probeURIs[i] ) {
+      _tickCost += COST_STATIC;
+      _server.send(204);
+      return;
+    }
+  }
+  if( !admit(COST_STATIC) ) return;
+  if( loggingLevel(FINE) ) Serial.printf_P(PSTR("OnNotFound:  %s NOT FOUND\n"),uri.c_str());
+  _server.send_P(404,"text/html",NotFound_page);
+}
+
+/**
+ *  Entry point for every portal route: record the request, then charge its cost
+ */
+boolean WiFiPortal::serve(RouteCost cost) {
+  traceRequest(_server.uri());
+  return admit(cost);
+}
+
+/**
+ *  Called from route handlers, once the Web server has parsed the request args. PSK values are masked so traces can be shared.
+ */
+void WiFiPortal::traceRequest(const String& uri) {
+  if( !_trace.enabled() ) return;
+  String      names[TRACE_MAX_ARGS];
+  String      values[TRACE_MAX_ARGS];
+  const char* namePtrs[TRACE_MAX_ARGS];
+  const char* valuePtrs[TRACE_MAX_ARGS];
+  int argc = _server.args();
+  if( argc > TRACE_MAX_ARGS ) argc = TRACE_MAX_ARGS;
+  for( int i=0; i<argc; i++ ) {
+    names[i]     = _server.argName(i);
+    values[i]    = (names[i].equalsIgnoreCase("PSK") ? String("*") : _server.arg(i));
+    namePtrs[i]  = names[i].c_str();
+    valuePtrs[i] = values[i].c_str();
+  }
+  _trace.request(millis(),uri.c_str(),argc,namePtrs,valuePtrs);
+}
+
 /**
  *  Display the portal page consisting of buttons for each available Access Point
  */
@@ -277,10 +961,25 @@ void WiFiPortal::display(WebContext* svr) {
    char buffer[DISPLAY_SIZE];
    int size = sizeof(buffer);
    int pos = formatHeader(buffer,size,"Select An Access Point");
-   WiFi.disconnect();
-   WiFi.scanDelete();
-   byte numSsid = WiFi.scanNetworks();
+
+/**
+ *  Reuse recent scan results so reloads of the portal page do not each cost a full radio scan
+ */
+   int  cached  = WiFi.scanComplete();
+   bool rescan  = (cached < 0 || millis() - _lastScan >= SCAN_CACHE);
+   byte numSsid = (byte)cached;
+   if( rescan ) {
+     disconnectSTA();
+     WiFi.scanDelete();
+     numSsid   = WiFi.scanNetworks();
+     _lastScan = millis();
+   }
    if( loggingLevel(FINE) ) Serial.printf_P(PSTR("display: Number of SSIDs found is %d\n"),numSsid);
+   if( rescan && _trace.enabled() ) {
+     unsigned long now = millis();
+     _trace.scan(now,numSsid);
+     for( int i=0; i<numSsid; i++ ) _trace.scanResult(now,WiFi.RSSI(i),WiFi.channel(i),WiFi.SSID(i).c_str());
+   }
    for( int i=0; i<numSsid; i++ ) {
      String ssidStr = WiFi.SSID(i);
      const char* ssid = ssidStr.c_str();
@@ -25,6 +25,7 @@
 #define WIFI_PORTAL_H
 
 #include <Arduino.h>
+#include <atomic>
 
 #ifdef ESP8266
 #include <ESP8266WiFi.h>
@@ -36,8 +37,12 @@
 #include <WebServer.h>
 #endif
 
+#include <WiFiUdp.h>
 #include <CommonProgmem.h>
 #include <WebContext.h>
+#include "PortalTrace.h"
+#include "ProvisionChannel.h"
+#include "WPAKey.h"
 
 /** Leelanau Software Company namespace 
 *  
@@ -49,13 +54,106 @@ namespace lsc {
 #define CANCEL_SIZE 100
 #define TIMEOUT     20000
 
+/**
+ *  Link supervisor defaults (milliseconds)
+ */
+#define RECONNECT_MIN_BACKOFF   2000
+#define RECONNECT_MAX_BACKOFF   60000
+#define OUTAGE_BUDGET           300000
+
+/**
+ *  Headless provisioning
+ */
+#define PROVISION_PORT          4210
+
+/**
+ *  Background roaming defaults
+ */
+#define ROAM_INTERVAL           60000
+#define ROAM_RSSI               -70
+#define ROAM_HYSTERESIS         10
+#define ROAM_HOLDOFF            300000
+
+/**
+ *  Admission control defaults. Route costs are in tokens, each client bucket holds ADMIT_BURST tokens and refills at
+ *  ADMIT_RATE tokens per second. ADMIT_TICK_BUDGET bounds the cost serviced per connectWiFi() call.
+ */
+#define ADMIT_CLIENTS           8
+#define ADMIT_BURST             12
+#define ADMIT_RATE              2
+#define ADMIT_TICK_BUDGET       4
+#define SCAN_CACHE              10000
+
+/**
+ *  Portal lifecycle defaults (milliseconds), 0 disables
+ */
+#define PORTAL_IDLE             0
+#define CREDENTIAL_RETRY        60000
+#define PORTAL_REOPEN           0
+
+/**
+ *  Threaded mode (ESP32 only)
+ */
+#define PORTAL_TASK_STACK       8192
+#define PORTAL_TASK_PRIORITY    1
+#define PORTAL_TASK_CORE        0
+#define PORTAL_TASK_PERIOD      10
+#define PORTAL_EVENTS           8
+#define SSID_SIZE               33
+#define SSID_WORDS              ((SSID_SIZE + 3) / 4)
+
+/**
+ *  Route cost classes, expensive routes are throttled first
+ */
+typedef enum RouteCost {
+  COST_STATIC  = 1,                     // Static content, forms, status pages
+  COST_CONNECT = 2,                     // Connection attempt
+  COST_SCAN    = 4                      // Radio scan
+} RouteCost;
+
+/**
+ *  Per-client token buckets keyed by IP address. The table is small and fixed; when full the least recently seen
+ *  client is evicted. Tokens are kept in thousandths so refill needs no floating point.
+ */
+class RateLimiter {
+  public:
+  RateLimiter() {}
+
+  boolean          admit(uint32_t ip, unsigned int cost, unsigned long now);
+  void             configure(unsigned int burst, unsigned int rate) {_burst = burst; _rate = rate;}
+  unsigned int     burst()                                 {return _burst;}
+  unsigned int     rate()                                  {return _rate;}
+  void             reset()                                 {memset(_clients,0,sizeof(_clients));}
+
+  private:
+  typedef struct Bucket {
+    uint32_t       ip;
+    unsigned long  tokens;
+    unsigned long  last;
+  } Bucket;
+
+  Bucket           _clients[ADMIT_CLIENTS] = {};
+  unsigned int     _burst                  = ADMIT_BURST;
+  unsigned int     _rate                   = ADMIT_RATE;
+};
+
+/**
+ *  Portal open/close requests, posted by openPortal()/closePortal() and consumed by the portal side
+ */
+typedef enum PortalRequest {
+  PORTAL_REQUEST_NONE,
+  PORTAL_REQUEST_OPEN,
+  PORTAL_REQUEST_CLOSE
+} PortalRequest;
+
 /**
  *  Connection state
  */
 typedef enum ConnectionState {
   CNX_DISCONNECTED,
   CNX_FINISHED,
-  CNX_CONNECTED
+  CNX_CONNECTED,
+  CNX_RECONNECTING
 } ConnectionState;
 
 /** WiFiPortal provides a WiFi portal wrapper for either ESP8266 or ESP32. 
@@ -77,6 +175,22 @@ typedef enum ConnectionState {
  *    (2) WiFi (for both ESP8266 and ESP32) does not persist hostname, so applications using mDNS must code that directly into the device. 
  *        Setting hostname on WiFiPortal with WiFiPortal.setHostname(String) prior to WiFiPortal.setup() will pass hostname on to the 
  *        underlying WiFi, so the mDNS hostname and the router hostname will match.
+ *    (3) With supervise(true), connectWiFi() can be called from the application loop after the connection sequence completes to 
+ *        watch the link. If the access point drops, state moves to CNX_RECONNECTING and reconnect attempts are made with jittered 
+ *        exponential backoff, the first targeted at the last known BSSID and channel. If the link is not restored within 
+ *        outageBudget() milliseconds, the portal is re-opened and state returns to CNX_DISCONNECTED.
+ *    (4) On ESP32, startTask() moves portal servicing onto its own FreeRTOS task after setup(). connectWiFi() then only reads 
+ *        published state and never blocks on HTTP or scanning. State and SSID are published through atomics, and state 
+ *        transitions are queued for nextEvent(). Other configuration must be done prior to startTask().
+ *    (5) Portal lifecycle. While the portal is running after stored credentials failed, those credentials are retried in the 
+ *        background every retryInterval() whenever no client is connected to the softAP. With portalIdle() set, the softAP and
+ *        Web server are shut down after that long without a client, and re-opened after reopenInterval(), on openPortal(), or
+ *        when the portalButton() pin goes active. State remains CNX_DISCONNECTED throughout. Retries are transient, and the retried
+ *        credentials are stored again only when a retry succeeds. openPortal() and closePortal() only post a request, carried out on the next portal pass.
+ *    (6) For WPA/WPA2 personal networks (including WPA2/WPA3 transition mode) passphrases entered in the portal are converted
+ *        once to the PMK, and the PMK (as 64 hex characters) is what WiFi persists. Later boots connect with the PMK directly 
+ *        and skip the 4096 iteration PBKDF2 derivation. WPA3 only (SAE), WEP, and networks missing from scan data keep the
+ *        key as entered.
  * 
  */
 class WiFiPortal {
@@ -100,13 +214,115 @@ public:
   void             setHostname(const char* host)           {String hostname(host); _hostname = hostname;}
   boolean          hasHostName()                           {return _hostname.length()!=0;}
   const char*      ssid()                                  {return _ssid.c_str();}
+  boolean          ssid(char* out, size_t size);       // Copy out the published SSID, safe from any task; false if none
   boolean          hasSSID()                               {return _ssid.length()!=0;}
   int              cnxTimeout()                            {return _timeout;}
   void             cnxTimeout(unsigned long timeout)       {_timeout = timeout;}
-  boolean          connectedState()                        {return _state == CNX_CONNECTED;}
-  boolean          finishedState()                         {return _state == CNX_FINISHED;}
-  boolean          disconnectedState()                     {return _state == CNX_DISCONNECTED;}
-  ConnectionState  getConnectionState()                    {return _state;}
+  boolean          connectedState()                        {return getConnectionState() == CNX_CONNECTED;}
+  boolean          finishedState()                         {return getConnectionState() == CNX_FINISHED;}
+  boolean          disconnectedState()                     {return getConnectionState() == CNX_DISCONNECTED;}
+  boolean          reconnectingState()                     {return getConnectionState() == CNX_RECONNECTING;}
+  ConnectionState  getConnectionState()                    {return _state.load();}
+  boolean          nextEvent(ConnectionState& state);  // Pop the oldest queued state transition, false if none
+
+/**
+ *  Threaded mode. startTask() runs portal servicing on its own FreeRTOS task pinned to core; stopTask() asks the task
+ *  to exit at the end of its current pass. In threaded mode ssid() belongs to the portal task; other tasks must use
+ *  ssid(out,size).
+ */
+#ifdef ESP32
+  boolean          startTask(int core = PORTAL_TASK_CORE, uint32_t stack = PORTAL_TASK_STACK, UBaseType_t priority = PORTAL_TASK_PRIORITY);
+  void             stopTask()                              {_stopTask.store(true);}
+#endif
+  boolean          threaded()                              {return _threaded.load();}
+
+/**
+ *  Link supervisor. When enabled, connectWiFi() watches the link once connected and reconnects on loss.
+ *  Backoff between reconnect attempts starts at minBackoff and doubles up to maxBackoff, with jitter, and an attempt in
+ *  progress always gets cnxTimeout() before the next one. WiFi auto reconnect is turned off while supervising.
+ *  The portal is re-opened once an outage exceeds outageBudget. Outage statistics are in milliseconds.
+ */
+  boolean          supervise()                             {return _supervise;}
+  void             supervise(boolean flag);
+  unsigned long    minBackoff()                            {return _minBackoff;}
+  unsigned long    maxBackoff()                            {return _maxBackoff;}
+  void             reconnectBackoff(unsigned long minMs, unsigned long maxMs);
+  unsigned long    outageBudget()                          {return _outageBudget;}
+  void             outageBudget(unsigned long budget)      {_outageBudget = budget;}
+  unsigned int     outageCount()                           {return _outageCount;}
+  unsigned long    outageDuration();                   // Duration of the current outage, or the last one if connected
+  unsigned long    longestOutage()                         {return _longestOutage;}
+  unsigned long    totalOutageTime()                       {return _totalOutage;}
+  void             resetOutageStats();
+
+/**
+ *  Background roaming. Connection attempts from the portal always pick the strongest BSSID for the selected SSID from scan 
+ *  data. With roam(true), connectWiFi() also samples WiFi.RSSI() every roamInterval() once connected. If RSSI falls below 
+ *  roamRSSI() an asynchronous scan is made, and the device re-associates if another BSSID for the same SSID is at least 
+ *  roamHysteresis() dB stronger. Re-association happens at most once per roamHoldoff() milliseconds.
+ *  Targeted connections never reach stored credentials: on ESP8266 persistence is suspended around begin(), on ESP32 the
+ *  driver is switched to RAM storage, since WiFi.persistent() there only applies at driver init. Credentials for the next
+ *  boot are stored separately, without a BSSID.
+ */
+  boolean          roam()                                  {return _roam;}
+  void             roam(boolean flag)                      {_roam = flag;}
+  unsigned long    roamInterval()                          {return _roamInterval;}
+  void             roamInterval(unsigned long ms)          {_roamInterval = ms;}
+  int              roamRSSI()                              {return _roamRSSI;}
+  void             roamRSSI(int rssi)                      {_roamRSSI = rssi;}
+  int              roamHysteresis()                        {return _roamHysteresis;}
+  void             roamHysteresis(int db)                  {_roamHysteresis = db;}
+  unsigned long    roamHoldoff()                           {return _roamHoldoff;}
+  void             roamHoldoff(unsigned long ms)           {_roamHoldoff = ms;}
+  unsigned int     roamCount()                             {return _roamCount;}
+
+/**
+ *  Portal lifecycle policy, see note (5) above. Intervals are in milliseconds, 0 disables.
+ */
+  unsigned long    portalIdle()                            {return _portalIdle;}
+  void             portalIdle(unsigned long ms)            {_portalIdle = ms;}
+  unsigned long    retryInterval()                         {return _retryInterval;}
+  void             retryInterval(unsigned long ms)         {_retryInterval = ms;}
+  unsigned long    reopenInterval()                        {return _reopenInterval;}
+  void             reopenInterval(unsigned long ms)        {_reopenInterval = ms;}
+  void             portalButton(int pin, int activeLevel = LOW);
+  boolean          portalOpen()                            {return _portalOpen.load();}
+  void             openPortal();                       // Requests are carried out on the next portal pass
+  void             closePortal();
+
+/**
+ *  Admission control for the portal Web server. Each request is charged its route cost against a per-client token bucket
+ *  and refused with 503 when the bucket is empty. OS connectivity probes are answered with 204 without building a page.
+ *  connectWiFi() services requests until requestBudget() cost has been spent or the server is idle.
+ */
+  boolean          admission()                             {return _admission;}
+  void             admission(boolean flag)                 {_admission = flag;}
+  void             rateLimit(unsigned int burst, unsigned int rate) {_limiter.configure(burst,rate);}
+  unsigned int     requestBudget()                         {return _requestBudget;}
+  void             requestBudget(unsigned int budget)      {_requestBudget = (budget > 0 ? budget : 1);}
+  unsigned long    rejectedCount()                         {return _rejected;}
+
+/**
+ *  Headless provisioning. While the portal is running, credentials can be supplied without a browser as a single line:
+ *      WIFI<TAB>ssid<TAB>psk<LF>
+ *  either on stream (typically &Serial) or as a UDP datagram (broadcast or unicast) to the softAP on port. The connection
+ *  attempt is the same as /connect, and the result is returned as one line to the sender:
+ *      OK<TAB>ssid<TAB>ip   |   FAIL<TAB>ssid<TAB>status   |   ERR<TAB>reason
+ *  UDP senders first receive ACK<TAB>ssid before the attempt. A successful join can move the softAP channel, so the UDP result
+ *  is best effort and only the Stream result is reliable. On OK the connection sequence completes on the next connectWiFi().
+ *  Must be called prior to setup(); a port of 0 disables UDP.
+ */
+  void             provisionStream(Stream* stream)         {_provStream = stream;}
+  void             provisionUDP(uint16_t port)             {_provPort = port;}
+  uint16_t         provisionPort()                         {return _provPort;}
+
+/**
+ *  Session trace. Records HTTP requests and args seen by the portal, WiFi.status() transitions, and scan results into buffer 
+ *  until stopTrace() is called or buffer fills. See PortalTrace for the format and for replay.
+ */
+  void             startTrace(uint8_t* buffer, size_t size) {_trace.begin(buffer,size,millis());}
+  void             stopTrace()                             {_trace.end();}
+  PortalTrace*     trace()                                 {return &_trace;}
 
 /**
  *  Reset Credentials. Portal is reset on next boot cycle of the device
@@ -121,11 +337,38 @@ public:
   boolean          loggingLevel(LoggingLevel level)        {return(logging() >= level);}
 
   private:
-  void             setSSID(String ssid)                    {_ssid = ssid;}
-  void             setConnectionState(ConnectionState s)   {_state = s;}
+  void             setSSID(String ssid);               // Sets and publishes SSID
+  void             setConnectionState(ConnectionState s); // Sets and publishes state, queuing the transition
+  int              serviceWiFi();                      // One pass of portal servicing, from connectWiFi() or the portal task
+#ifdef ESP32
+  static void      portalTask(void* arg);
+#endif
   void             finish();
   void             startPortal();
   int              attemptConnect(String ssid, String psk);
+  boolean          admit(RouteCost cost);              // Charge cost to the requesting client, sends 503 if refused
+  void             serveNotFound();                    // Fast path for probes and unknown URIs
+  boolean          serve(RouteCost cost);              // Trace and admit a request, wraps every portal route
+  void             traceRequest(const String& uri);    // Record a request with its args, called from route handlers
+  void             traceStatus()                           {if(_trace.enabled()) _trace.status(millis(),WiFi.status());}
+  void             portalLifecycle();                  // Idle shutdown, credential retry, and reopen, called from connectWiFi()
+  void             saveCredentials();                  // Keep stored credentials for background retry before the portal starts
+  boolean          stationConfig(String& ssid, String& psk, boolean stored); // Bounded copy of the station config
+  void             reopenPortal();                     // Carry out openPortal() on the portal side
+  void             shutdownPortal();                   // Carry out closePortal() on the portal side
+  void             pollProvision();                    // Service headless provisioning channels, called from connectWiFi()
+  void             provision(const char* ssid, const char* psk, char* reply, size_t size);
+  int              bestNetwork(const String& ssid, int count); // Index of the strongest scan result for ssid, or -1
+  boolean          pskNetwork(int index);              // Scan result index accepts a WPA/WPA2 PMK
+  void             beginBest(const String& ssid, const String& psk);
+  void             beginTransient(const String& ssid, const String& psk, int32_t channel = 0, const uint8_t* bssid = NULL);
+  void             persistCredentials(const String& ssid, const String& psk); // Store credentials without connecting
+  void             monitorRoam();                      // Background roaming, called from connectWiFi()
+  void             superviseLink();                    // Watch the link and reconnect on loss, called from connectWiFi()
+  void             linkUp();                           // Record SSID, PSK, BSSID and channel of the current connection
+  void             linkLost(unsigned long now);        // Start outage tracking
+  void             endOutage(unsigned long now);       // Accumulate outage statistics
+  void             reconnect();                        // Issue a single non-blocking reconnect attempt
 /**
  *   Http handlers for the AP Portal. These methods are used when the device is acting as a portal
  *   in AP and STA mode. All handlers are set on the internal Web server
@@ -144,6 +387,7 @@ public:
   void             updateMDNS();                       // Abstracted for ESP8266 and ESP32
   
   void             resetAP();                          // Reset soft AP state to start up
+  void             disconnectSTA();                    // Disconnect the station without erasing persisted credentials
 
   boolean          _disconnectSoftAP  = true;
   const char*      _apName            = "WiFiPortal";
@@ -154,7 +398,85 @@ public:
   MDNSResponder    _mDNS;
   WebContext       _ctx;
   LoggingLevel     _logging           = NONE;
-  ConnectionState  _state             = CNX_DISCONNECTED;
+
+/**
+ *  State shared with the application. The portal side is the only writer. SSID is published under a sequence lock: 
+ *  _ssidSeq is odd while the words are being written, and readers retry until they see the same even sequence before 
+ *  and after copying. Transitions go through a single producer, single consumer ring.
+ */
+  std::atomic<ConnectionState> _state{CNX_DISCONNECTED};
+  std::atomic<uint32_t>        _ssidSeq{0};
+  std::atomic<uint32_t>        _ssidWords[SSID_WORDS] = {};
+  ConnectionState  _events[PORTAL_EVENTS];
+  std::atomic<uint8_t>         _eventHead{0};
+  std::atomic<uint8_t>         _eventTail{0};
+  std::atomic<bool>            _threaded{false};
+  std::atomic<bool>            _stopTask{false};
+  PortalTrace      _trace;
+  RateLimiter      _limiter;
+  boolean          _admission         = true;
+  unsigned int     _requestBudget     = ADMIT_TICK_BUDGET;
+  unsigned int     _tickCost          = 0;
+  unsigned long    _rejected          = 0;
+  unsigned long    _lastScan          = 0;
+
+/**
+ *  Portal lifecycle state
+ */
+  unsigned long    _portalIdle        = PORTAL_IDLE;
+  unsigned long    _retryInterval     = CREDENTIAL_RETRY;
+  unsigned long    _reopenInterval    = PORTAL_REOPEN;
+  int              _buttonPin         = -1;
+  int              _buttonLevel       = LOW;
+  std::atomic<bool>            _portalOpen{false};
+  std::atomic<uint8_t>         _portalRequest{PORTAL_REQUEST_NONE};
+  boolean          _retrying          = false;
+  unsigned long    _lastActivity      = 0;
+  unsigned long    _lastRetry         = 0;
+  unsigned long    _retryStart        = 0;
+  unsigned long    _closedAt          = 0;
+  String           _storedSSID        = EMPTY_STRING;
+  String           _storedPSK         = EMPTY_STRING;
+  Stream*          _provStream        = NULL;
+  uint16_t         _provPort          = 0;
+  WiFiUDP          _udp;
+  ProvisionChannel _provChannel;
+  boolean          _portalStarted     = false;
+
+/**
+ *  Link supervisor state
+ */
+  boolean          _supervise         = false;
+  unsigned long    _minBackoff        = RECONNECT_MIN_BACKOFF;
+  unsigned long    _maxBackoff        = RECONNECT_MAX_BACKOFF;
+  unsigned long    _outageBudget      = OUTAGE_BUDGET;
+  String           _linkPSK           = EMPTY_STRING;
+  uint8_t          _bssid[6]          = {0};
+  int32_t          _channel           = 0;
+  boolean          _hasBSSID          = false;
+  unsigned int     _attempts          = 0;
+  unsigned long    _outageStart       = 0;
+  unsigned long    _nextAttempt       = 0;
+  unsigned long    _attemptStart      = 0;
+  unsigned int     _outageCount       = 0;
+  unsigned long    _lastOutage        = 0;
+  unsigned long    _longestOutage     = 0;
+  unsigned long    _totalOutage       = 0;
+
+/**
+ *  Roaming state
+ */
+  boolean          _roam              = false;
+  unsigned long    _roamInterval      = ROAM_INTERVAL;
+  int              _roamRSSI          = ROAM_RSSI;
+  int              _roamHysteresis    = ROAM_HYSTERESIS;
+  unsigned long    _roamHoldoff       = ROAM_HOLDOFF;
+  unsigned long    _roamSample        = 0;
+  unsigned long    _roamStart         = 0;
+  unsigned long    _lastRoam          = 0;
+  boolean          _roamScan          = false;
+  boolean          _roamed            = false;
+  unsigned int     _roamCount         = 0;
 
 #ifdef ESP8266
   ESP8266WebServer  _server;